@@ -0,0 +1,56 @@
+#!/usr/bin/env lua
+
+-- Throughput benchmark for the canonical grammars in 'grammars.lua'.
+--
+-- usage: lua bench/bench.lua [sizes] [name...]
+--   sizes: comma-separated subject sizes, with an optional suffix
+--          K, M or G (default: 1K,64K,1M)
+--   name:  grammars to run (default: all)
+--
+-- Output is tab-separated, one line per grammar and size:
+--   grammar  size  sec/match  MB/s  matches/s  allocKB  peakKB
+-- where 'allocKB' is what one match allocates in the Lua heap and
+-- 'peakKB' is the size of the heap at the end of that match (with the
+-- collector stopped), subject included. Lines starting with '#' are
+-- comments. Use 'compare.lua' to compare two outputs.
+
+local dir = arg and arg[0] and arg[0]:match("^(.*)[/\\]") or "."
+package.path = dir .. "/?.lua;" .. dir .. "/../?.lua;" .. package.path
+package.cpath = dir .. "/../?.so;" .. package.cpath
+
+local m = require"lpeg"
+local harness = require"harness"
+local grammars = require"grammars"
+
+
+local sizes = {}
+for s in (arg[1] or "1K,64K,1M"):gmatch("[^,]+") do
+  sizes[#sizes + 1] = harness.parsesize(s)
+end
+
+local selected
+if arg[2] then
+  selected = {}
+  for i = 2, #arg do selected[arg[i]] = true end
+end
+
+
+print(string.format("# lpeg %s, %s", m.version(), _VERSION))
+print("# grammar\tsize\tsec/match\tMB/s\tmatches/s\tallocKB\tpeakKB")
+for _, g in ipairs(grammars) do
+  if not selected or selected[g.name] then
+    for _, size in ipairs(sizes) do
+      local s = g.gen(size)
+      if not g.patt:match(s) then
+        error("grammar '" .. g.name .. "' does not match its subject")
+      end
+      local t = harness.timeit(g.patt, s)
+      local alloc, peak = harness.memory(g.patt, s)
+      print(string.format("%s\t%d\t%.6g\t%.2f\t%.2f\t%.1f\t%.1f", g.name, #s,
+                          t, #s / t / 2^20, 1 / t, alloc, peak))
+      io.stdout:flush()
+      s = nil
+      collectgarbage("collect")
+    end
+  end
+end
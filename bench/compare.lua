@@ -0,0 +1,40 @@
+#!/usr/bin/env lua
+
+-- Compare two outputs of 'bench.lua' (for instance, from two commits).
+--
+-- usage: lua bench/compare.lua old.tsv new.tsv
+--
+-- For each grammar and size present in both files, prints the
+-- throughput in each one and their ratio (new/old; above 1 means the
+-- new version is faster), plus the allocations per match in each one.
+
+local function load (fname)
+  local t = {}
+  for line in assert(io.open(fname)):lines() do
+    if not line:match("^#") then
+      local name, size, _, mbs, _, alloc = line:match(
+        "^(%S+)\t(%d+)\t(%S+)\t(%S+)\t(%S+)\t(%S+)")
+      if name then
+        t[#t + 1] = {key = name .. "\t" .. size, mbs = tonumber(mbs),
+                     alloc = tonumber(alloc)}
+        t[name .. "\t" .. size] = t[#t]
+      end
+    end
+  end
+  return t
+end
+
+if #arg ~= 2 then
+  io.stderr:write("usage: lua compare.lua old.tsv new.tsv\n")
+  os.exit(1)
+end
+
+local old, new = load(arg[1]), load(arg[2])
+print("# grammar\tsize\toldMB/s\tnewMB/s\tratio\toldKB\tnewKB")
+for _, o in ipairs(old) do
+  local n = new[o.key]
+  if n then
+    print(string.format("%s\t%.2f\t%.2f\t%.3f\t%.1f\t%.1f", o.key, o.mbs,
+                        n.mbs, n.mbs / o.mbs, o.alloc, n.alloc))
+  end
+end
@@ -0,0 +1,151 @@
+#!/usr/bin/env lua
+
+-- Cost of building and compiling large patterns.
+--
+-- usage: lua bench/compile.lua [counts] [name...]
+--   counts: comma-separated numbers of rules (for grammars) or of
+--           items (for other patterns) (default: 100,1000,10000)
+--   name:   cases to run (default: all)
+--
+-- For each case and count, prints a tab-separated line:
+--   case  count  nodes  codesize  construct  grammar  finalfix  verify
+--   analysis  codegen  peephole  total
+-- where 'nodes' is the size of the tree, 'codesize' is the number of
+-- instructions, and the other columns are the seconds spent in each
+-- phase: 'construct' is the time to build the pieces in Lua; the others
+-- come from 'lpeg.compilestats'. Grammars with more than MAXRULES rules
+-- (1000, by default) are reported as comments; build the library with
+-- a larger MAXRULES (e.g., make COPT="-O2 -DMAXRULES=20000") to run them.
+-- (Choices are compiled as a chain of alternatives, and code generation
+-- recurses along the chain; so, 'choice' with much more than 50000
+-- alternatives may exhaust the C stack.)
+
+local dir = arg and arg[0] and arg[0]:match("^(.*)[/\\]") or "."
+package.path = dir .. "/?.lua;" .. dir .. "/../?.lua;" .. package.path
+package.cpath = dir .. "/../?.so;" .. package.cpath
+
+local m = require"lpeg"
+local harness = require"harness"
+
+
+-- combine the 'n' results of 'item(i)' with 'op', as a balanced tree
+-- (a left fold would copy the pattern built so far at each step)
+local function balanced (n, item, op)
+  local function build (i, j)
+    if i == j then return item(i) end
+    local mid = math.floor((i + j) / 2)
+    return op(build(i, mid), build(mid + 1, j))
+  end
+  return build(1, n)
+end
+
+local function seq (a, b) return a * b end
+local function choice (a, b) return a + b end
+
+
+local cases = {
+  {
+    name = "rules",   -- r_i <- 'k<i>' r_(i+1) / [0-9]+
+    gen = function (n)
+      local g = {"r1"}
+      for i = 1, n do
+        g["r" .. i] = m.P("k" .. i) * m.V("r" .. (i % n + 1)) + m.R"09"^1
+      end
+      return g
+    end,
+  },
+  {
+    name = "lr",   -- r_i <- r_i '+' r_(i+1) / r_(i+1);  r_n <- [0-9]+
+    gen = function (n)
+      local g = {"r1"}
+      for i = 1, n - 1 do
+        local next = m.V("r" .. (i + 1))
+        g["r" .. i] = m.V("r" .. i) * "+" * next + next
+      end
+      g["r" .. n] = m.R"09"^1
+      return g
+    end,
+  },
+  {
+    name = "choice",   -- 'w1x' / 'w2x' / ...
+    gen = function (n)
+      return balanced(n, function (i) return m.P("w" .. i .. "x") end, choice)
+    end,
+  },
+  {
+    name = "choicen",   -- same as 'choice', built with 'lpeg.choice'
+    gen = function (n)
+      local t = {}
+      for i = 1, n do t[i] = m.P("w" .. i .. "x") end
+      return m.choice(t)
+    end,
+  },
+  {
+    name = "seq",   -- ('a'? [xyz])*
+    gen = function (n)
+      return balanced(n, function () return m.P"a"^-1 * m.S"xyz" end, seq)
+    end,
+  },
+}
+
+
+local counts = {}
+for s in (arg[1] or "100,1000,10000"):gmatch("[^,]+") do
+  counts[#counts + 1] = assert(tonumber(s), "invalid count")
+end
+
+local selected
+if arg[2] then
+  selected = {}
+  for i = 2, #arg do selected[arg[i]] = true end
+end
+
+
+local phases = {"grammar", "finalfix", "verify", "analysis", "codegen",
+                "peephole"}
+
+-- average times of building and compiling the pattern for case 'c'
+-- with count 'n', over runs lasting at least 'harness.BATCHTIME'
+local function measure (c, n)
+  local sum = {construct = 0}
+  for _, ph in ipairs(phases) do sum[ph] = 0 end
+  local runs, stats = 0
+  local t0 = os.clock()
+  repeat
+    local t = os.clock()
+    local p = c.gen(n)
+    sum.construct = sum.construct + (os.clock() - t)
+    p, stats = m.compilestats(p)
+    for _, ph in ipairs(phases) do sum[ph] = sum[ph] + stats[ph] end
+    runs = runs + 1
+  until os.clock() - t0 >= harness.BATCHTIME
+  for k, v in pairs(sum) do sum[k] = v / runs end
+  return sum, stats
+end
+
+
+print(string.format("# lpeg %s, %s", m.version(), _VERSION))
+print("# case\tcount\tnodes\tcodesize\tconstruct\tgrammar\tfinalfix\t" ..
+      "verify\tanalysis\tcodegen\tpeephole\ttotal")
+for _, c in ipairs(cases) do
+  if not selected or selected[c.name] then
+    for _, n in ipairs(counts) do
+      local ok, t, stats = pcall(measure, c, n)
+      if not ok then
+        print(string.format("# %s\t%d\t%s", c.name, n, t))
+      else
+        local total = t.construct
+        local line = {c.name, n, stats.nodes, stats.codesize,
+                      string.format("%.6g", t.construct)}
+        for _, ph in ipairs(phases) do
+          line[#line + 1] = string.format("%.6g", t[ph])
+          total = total + t[ph]
+        end
+        line[#line + 1] = string.format("%.6g", total)
+        print(table.concat(line, "\t"))
+      end
+      io.stdout:flush()
+      collectgarbage("collect")
+    end
+  end
+end
@@ -0,0 +1,209 @@
+-- Canonical grammars for the benchmarks (see 'bench.lua').
+-- Each entry has a 'name', a pattern 'patt', and a function 'gen'
+-- that generates a subject with at least 'size' bytes that 'patt'
+-- matches entirely. Patterns with captures evaluate them piece by
+-- piece (with match-time captures), so that the memory of a match does
+-- not grow with its subject.
+
+local m = require"lpeg"
+local re = require"re"
+
+
+-- repeat 'unit' (a function of the repetition number) until the
+-- result has at least 'size' bytes, joining the pieces with 'sep'
+local function build (size, unit, sep)
+  local t = {}
+  local n = 0
+  local i = 1
+  sep = sep or ""
+  while n < size do
+    local u = unit(i)
+    t[#t + 1] = u
+    n = n + #u + #sep
+    i = i + 1
+  end
+  return table.concat(t, sep)
+end
+
+
+-- evaluate the captures of 'p' and drop their values
+local function drop (p)
+  return m.Cmt(p, function (_, i) return i end)
+end
+
+
+local space = m.S" \t\r\n"^0
+local digit = m.R"09"
+local alpha = m.R("az", "AZ") + "_"
+local alnum = alpha + digit
+
+
+local grammars = {}
+
+
+-- JSON (with captures for strings and numbers)
+do
+  local str = '"' * m.C(((1 - m.S'"\\') + "\\" * m.P(1))^0) * '"'
+  local number = m.C(m.P"-"^-1 * digit^1 * ("." * digit^1)^-1 *
+                     (m.S"eE" * m.S"+-"^-1 * digit^1)^-1) / tonumber
+  local json = m.P{ "V";
+    V = space * (m.V"O" + m.V"A" + str + number +
+                 "true" + "false" + "null") * space,
+    O = "{" * space * (m.V"M" * ("," * space * m.V"M")^0)^-1 * "}",
+    M = str * space * ":" * m.V"V",
+    A = "[" * space * (m.V"V" * ("," * m.V"V")^0)^-1 * "]",
+  }
+  local item = drop(json)
+  grammars[#grammars + 1] = {
+    name = "json",
+    patt = space * "[" * item * ("," * item)^0 * "]" * space * -1,
+    gen = function (size)
+      return "[" .. build(size, function (i)
+        return string.format(
+          '{"id": %d, "name": "item %d", "tags": ["a", "b\\"c"], ' ..
+          '"price": %d.%02d, "ok": %s, "next": null}',
+          i, i, i % 1000, i % 100, (i % 2 == 0) and "true" or "false")
+      end, ",\n") .. "]"
+    end,
+  }
+end
+
+
+-- CSV with quoted fields
+do
+  local field = '"' * (1 - m.P'"' + '""')^0 * '"' + (1 - m.S',\n"')^0
+  local record = field * ("," * field)^0 * "\n"
+  grammars[#grammars + 1] = {
+    name = "csv",
+    patt = record^0 * -1,
+    gen = function (size)
+      return build(size, function (i)
+        return string.format('%d,"name, %d","say ""hi""",%d.5,plain text\n',
+                             i, i, i % 777)
+      end)
+    end,
+  }
+end
+
+
+-- HTTP request lines and headers
+do
+  local token = (1 - m.S"()<>@,;:\\\"/[]?={} \t\r\n")^1
+  local uri = (1 - m.S" \r\n")^1
+  local request = token * " " * uri * " HTTP/" * digit * "." * digit * "\r\n"
+  local header = token * ":" * m.S" \t"^0 * (1 - m.S"\r\n")^0 * "\r\n"
+  grammars[#grammars + 1] = {
+    name = "http",
+    patt = (request * header^0 * "\r\n")^0 * -1,
+    gen = function (size)
+      return build(size, function (i)
+        return string.format("GET /api/v1/items/%d?sort=asc&page=%d HTTP/1.1\r\n"
+          .. "Host: example.com\r\nUser-Agent: bench/1.0\r\n"
+          .. "Accept: */*\r\nX-Request-Id: %08x\r\n\r\n", i, i % 10, i)
+      end)
+    end,
+  }
+end
+
+
+-- Lua lexer
+do
+  local longstring = m.P{ "L";
+    L = "[" * m.Cg(m.P"="^0, "eq") * "[" * (1 - m.V"C")^0 * m.V"C",
+    C = "]" * m.Cmt(m.C(m.P"="^0) * "]" * m.Cb"eq",
+                    function (_, _, a, b) return a == b end),
+  }
+  local comment = "--" * (longstring + (1 - m.P"\n")^0)
+  local str = '"' * ((1 - m.S'"\\\n') + "\\" * m.P(1))^0 * '"' +
+              "'" * ((1 - m.S"'\\\n") + "\\" * m.P(1))^0 * "'" + longstring
+  local number = "0x" * m.R("09", "af", "AF")^1 +
+                 digit^1 * ("." * digit^0)^-1 * (m.S"eE" * m.S"+-"^-1 * digit^1)^-1
+  local name = alpha * alnum^0
+  local op = m.P"..." + ".." + "==" + "~=" + "<=" + ">=" + "::" + "//" +
+             m.S"+-*/%^#&~|<>=(){}[];:,."
+  local token = comment + str + number + name + op
+  grammars[#grammars + 1] = {
+    name = "lualex",
+    patt = (m.S" \t\r\n"^1 + token)^0 * -1,
+    gen = function (size)
+      return build(size, function (i)
+        return string.format([==[
+-- function number %d
+local function f%d (a, b, ...)
+  local t = {x = 0x%x, y = %d.5e-3, s = "str\"ing", [[long]] }
+  if a ~= b and #t >= 2 then return a .. b else return t[1] // 2 end
+end
+]==], i, i, i, i)
+      end)
+    end,
+  }
+end
+
+
+-- Left-recursive arithmetic
+do
+  local num = space * digit^1 * space
+  local arith = m.P{ "E";
+    E = m.V"E" * m.S"+-" * m.V"T" + m.V"T",
+    T = m.V"T" * m.S"*/" * m.V"F" + m.V"F",
+    F = num + space * "(" * m.V"E" * ")" * space,
+  }
+  grammars[#grammars + 1] = {
+    name = "lrarith",
+    patt = arith * -1,
+    gen = function (size)
+      return "0" .. build(size, function (i)
+        return string.format(" + %d * (%d - %d) / 7", i, i % 13, i % 5)
+      end)
+    end,
+  }
+end
+
+
+-- Keyword alternations
+do
+  local keywords = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for",
+    "function", "goto", "if", "in", "local", "nil", "not", "or",
+    "repeat", "return", "then", "true", "until", "while",
+    "auto", "case", "char", "const", "continue", "default", "double",
+    "enum", "extern", "float", "inline", "int", "long", "register",
+    "short", "signed", "sizeof", "static", "struct", "switch",
+    "typedef", "union", "unsigned", "void", "volatile",
+  }
+  local kw = m.P(false)
+  for _, k in ipairs(keywords) do kw = kw + k end
+  local word = kw * -alnum + alpha * alnum^0
+  grammars[#grammars + 1] = {
+    name = "keywords",
+    patt = (word + (1 - alpha))^0 * -1,
+    gen = function (size)
+      return build(size, function (i)
+        return keywords[i % #keywords + 1] .. " ident" .. i .. " " ..
+               keywords[(i * 7) % #keywords + 1] .. "x;"
+      end, " ")
+    end,
+  }
+end
+
+
+-- 're' patterns
+do
+  local email = re.compile([[
+    mails <- (mail => drop / .)*
+    mail <- {| {:user: [_.%w]+ :} '@' {:host: [_%w]+ ('.' [_%w]+)+ :} |}
+  ]], {drop = function (_, i) return i end})
+  grammars[#grammars + 1] = {
+    name = "re",
+    patt = email * -1,
+    gen = function (size)
+      return build(size, function (i)
+        return string.format("contact user%d@host%d.example.org, " ..
+                             "or see http://example.org/%d.", i, i % 10, i)
+      end, "\n")
+    end,
+  }
+end
+
+
+return grammars
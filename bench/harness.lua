@@ -0,0 +1,63 @@
+-- Common functions for the benchmarks
+
+local harness = {}
+
+
+-- minimum time of each batch of runs, and number of batches
+harness.BATCHTIME = 0.1
+harness.NBATCHES = 3
+
+
+-- convert a size such as "64K" into a number of bytes
+function harness.parsesize (s)
+  local n, suffix = s:match("^(%d+)([KMGkmg]?)$")
+  if not n then error("invalid size '" .. s .. "'") end
+  local mult = {[""] = 1, k = 2^10, m = 2^20, g = 2^30}
+  return math.floor(tonumber(n) * mult[suffix:lower()])
+end
+
+
+-- time of one call to 'f(...)': the best over some batches of calls
+function harness.timecall (f, ...)
+  local best = math.huge
+  for _ = 1, harness.NBATCHES do
+    local n = 0
+    local t0 = os.clock()
+    local t
+    repeat
+      f(...)
+      n = n + 1
+      t = os.clock() - t0
+    until t >= harness.BATCHTIME
+    best = math.min(best, t / n)
+  end
+  return best
+end
+
+
+-- time of one match of 'p' against 's'
+function harness.timeit (p, s)
+  return harness.timecall(p.match, p, s)
+end
+
+
+-- memory allocated by one call to 'f(...)', and size of the heap
+-- after it (in KB, with the collector stopped)
+function harness.memcall (f, ...)
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  f(...)
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  return after - before, after
+end
+
+
+-- memory allocated by one match of 'p' against 's'
+function harness.memory (p, s)
+  return harness.memcall(p.match, p, s)
+end
+
+
+return harness
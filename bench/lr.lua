@@ -0,0 +1,159 @@
+#!/usr/bin/env lua
+
+-- Scaling of left-recursive grammars.
+--
+-- usage: lua bench/lr.lua [counts] [name...]
+--   counts: comma-separated numbers of operands in each subject
+--           (default: 10,1000,100000)
+--   name:   cases to run (default: all)
+--
+-- For each case and number of operands, prints a tab-separated line:
+--   case  operands  sec/match  allocKB  lrentries  lrgrowths
+--   lrcapbytes  timegrowth  memgrowth
+-- where the 'lr' columns come from 'lpeg.profile' and the growth
+-- columns compare time and memory with the previous line, divided by
+-- the growth in operands (so, 1 is linear growth). A growth above
+-- LIMIT, when the previous measure is large enough to be meaningful,
+-- is reported at the end, and the script exits with an error; larger
+-- counts for that case are skipped, as they could take too long.
+
+local dir = arg and arg[0] and arg[0]:match("^(.*)[/\\]") or "."
+package.path = dir .. "/?.lua;" .. dir .. "/../?.lua;" .. package.path
+package.cpath = dir .. "/../?.so;" .. package.cpath
+
+local m = require"lpeg"
+local harness = require"harness"
+
+
+-- maximum growth (relative to the number of operands) accepted
+local LIMIT = 3
+
+-- minimum time (seconds) and memory (KB) for a meaningful growth
+local MINTIME = 1e-4
+local MINMEM = 4
+
+
+local num = m.C(m.R"09"^1)
+
+-- build a subject with 'n' operands: 'first' followed by 'n - 1'
+-- results of 'rest(i)'
+local function chain (n, first, rest)
+  local t = {first}
+  for i = 2, n do t[i] = rest(i) end
+  return table.concat(t)
+end
+
+
+local cases = {
+  {
+    name = "leftassoc",   -- E <- E '+' n / n
+    patt = m.P{ "E"; E = m.V"E" * "+" * num + num },
+    gen = function (n)
+      return chain(n, "1", function (i) return "+" .. i end)
+    end,
+  },
+  {
+    name = "precedence",   -- arithmetic with two levels of precedence
+    patt = m.P{ "E";
+      E = m.V"E" * m.C(m.S"+-") * m.V"T" + m.V"T",
+      T = m.V"T" * m.C(m.S"*/") * m.V"F" + m.V"F",
+      F = num + "(" * m.V"E" * ")",
+    },
+    gen = function (n)
+      local ops = {"+", "*", "-", "/"}
+      return chain(n, "1", function (i)
+        if i % 10 == 0 then return "*(" .. i .. "-1)" end
+        return ops[i % 4 + 1] .. i
+      end)
+    end,
+  },
+  {
+    name = "indirect",   -- L <- P '.x' / 'x';  P <- P '(n)' / L
+    patt = m.P{ "L";
+      L = m.V"P" * m.C".x" + m.C"x",
+      P = m.V"P" * m.C"(n)" + m.V"L",
+    },
+    gen = function (n)
+      return chain(n, "x", function (i)
+        return (i % 3 == 0 or i == n) and ".x" or "(n)"   -- end with '.x'
+      end)
+    end,
+  },
+  {
+    name = "multientry",   -- mutually left-recursive A and B
+    patt = m.P{ "S";
+      S = m.V"A" + m.V"B",
+      A = m.V"A" * m.C"a" + m.V"B" + m.C"a",
+      B = m.V"B" * m.C"b" + m.V"A" + m.C"b",
+    },
+    gen = function (n)
+      return chain(n, "b", function (i)
+        return (i % 5 < 2) and "b" or "a"
+      end)
+    end,
+  },
+}
+
+
+local counts = {}
+for s in (arg[1] or "10,1000,100000"):gmatch("[^,]+") do
+  counts[#counts + 1] = assert(tonumber(s), "invalid count")
+end
+
+local selected
+if arg[2] then
+  selected = {}
+  for i = 2, #arg do selected[arg[i]] = true end
+end
+
+
+local function growth (x, prevx, n, prevn, min)
+  if not prevx or prevx < min then return nil end
+  return (x / prevx) / (n / prevn)
+end
+
+local function fmt (g)
+  return g and string.format("%.2f", g) or "-"
+end
+
+
+local failures = {}
+print(string.format("# lpeg %s, %s", m.version(), _VERSION))
+print("# case\toperands\tsec/match\tallocKB\tlrentries\tlrgrowths\t" ..
+      "lrcapbytes\ttimegrowth\tmemgrowth")
+for _, c in ipairs(cases) do
+  if not selected or selected[c.name] then
+    local patt = c.patt * -1
+    local prev = {}
+    local nonlinear = false
+    for _, n in ipairs(counts) do
+      if nonlinear then break end
+      local s = c.gen(n)
+      local prof = m.profile(patt, s)
+      if not patt:match(s) then
+        error("case '" .. c.name .. "' does not match its subject")
+      end
+      local t = harness.timeit(patt, s)
+      local alloc = harness.memory(patt, s)
+      local tg = growth(t, prev.t, n, prev.n, MINTIME)
+      local mg = growth(alloc, prev.alloc, n, prev.n, MINMEM)
+      print(string.format("%s\t%d\t%.6g\t%.1f\t%d\t%d\t%d\t%s\t%s", c.name, n,
+                          t, alloc, prof.lrentries, prof.lrgrowths,
+                          prof.lrcapbytes, fmt(tg), fmt(mg)))
+      io.stdout:flush()
+      if (tg and tg > LIMIT) or (mg and mg > LIMIT) then
+        failures[#failures + 1] = string.format("%s with %d operands",
+                                                c.name, n)
+        nonlinear = true
+      end
+      prev = {t = t, alloc = alloc, n = n}
+      s = nil
+      collectgarbage("collect")
+    end
+  end
+end
+
+if #failures > 0 then
+  io.stderr:write("non-linear growth: ", table.concat(failures, "; "), "\n")
+  os.exit(1)
+end
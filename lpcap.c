@@ -3,6 +3,8 @@
 ** Copyright 2007, Lua.org & PUC-Rio  (see 'lpeg.html' for license)
 */
 
+#include <string.h>
+
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -14,7 +16,10 @@
 
 #define isclosecap(cap)	(captype(cap) == Cclose)
 
-#define closeaddr(c)	((c)->s + (c)->siz - 1)
+/* subject position of a capture */
+#define capsubj(cs,c)	((cs)->s + (c)->index)
+
+#define closeaddr(cs,c)	(capsubj(cs,c) + (c)->siz - 1)
 
 #define isfullcap(cap)	((cap)->siz != 0)
 
@@ -40,6 +45,7 @@ static int updatecache (CapState *cs, int v) {
 
 
 static int pushcapture (CapState *cs);
+static int pushnestedvalues (CapState *cs);
 
 
 /*
@@ -76,43 +82,6 @@ static void nextcap (CapState *cs) {
 }
 
 
-/*
-** Push on the Lua stack all values generated by nested captures inside
-** the current capture. Returns number of values pushed. 'addextra'
-** makes it push the entire match after all captured values. The
-** entire match is pushed also if there are no other nested values,
-** so the function never returns zero.
-*/
-static int pushnestedvalues (CapState *cs, int addextra) {
-  Capture *co = cs->cap;
-  if (isfullcap(cs->cap++)) {  /* no nested captures? */
-    lua_pushlstring(cs->L, co->s, co->siz - 1);  /* push whole match */
-    return 1;  /* that is it */
-  }
-  else {
-    int n = 0;
-    while (!isclosecap(cs->cap))  /* repeat for all nested patterns */
-      n += pushcapture(cs);
-    if (addextra || n == 0) {  /* need extra? */
-      lua_pushlstring(cs->L, co->s, cs->cap->s - co->s);  /* push whole match */
-      n++;
-    }
-    cs->cap++;  /* skip close entry */
-    return n;
-  }
-}
-
-
-/*
-** Push only the first value generated by nested captures
-*/
-static void pushonenestedvalue (CapState *cs) {
-  int n = pushnestedvalues(cs, 0);
-  if (n > 1)
-    lua_pop(cs->L, n - 1);  /* pop extra values */
-}
-
-
 /*
 ** Try to find a named group capture with the name given at the top of
 ** the stack; goes backward from 'cap'.
@@ -139,123 +108,387 @@ static Capture *findback (CapState *cs, Capture *cap) {
 
 
 /*
-** Back-reference capture. Return number of values pushed.
+** Number of entries in the list of captures starting at 'cap' (not
+** counting its final close entry)
 */
-static int backrefcap (CapState *cs) {
-  int n;
-  Capture *curr = cs->cap;
-  pushluaval(cs);  /* reference name */
-  cs->cap = findback(cs, curr);  /* find corresponding group */
-  n = pushnestedvalues(cs, 0);  /* push group's values */
-  cs->cap = curr + 1;
+static int caplistsize (Capture *cap) {
+  int n, level = 0;
+  for (n = 0; level > 0 || !isclosecap(cap + n); n++) {
+    if (isclosecap(cap + n)) level--;
+    else if (!isfullcap(cap + n)) level++;
+  }
   return n;
 }
 
 
 /*
-** Table capture: creates a new table and populates it with nested
-** captures.
+** Check whether the group name at the top of the stack can be used as
+** a key in the index of group names, that is, whether raw equality
+** of keys is the same as the equality used by 'findback'. (Tables and
+** full userdata may have '__eq' metamethods; NaN is not a valid key.)
 */
-static int tablecap (CapState *cs) {
+static int indexablename (lua_State *L) {
+  switch (lua_type(L, -1)) {
+    case LUA_TSTRING: case LUA_TBOOLEAN: case LUA_TLIGHTUSERDATA:
+      return 1;
+    case LUA_TNUMBER:
+      return lua_rawequal(L, -1, -1);  /* not NaN? */
+    default:
+      return 0;
+  }
+}
+
+
+/*
+** Resolution of back references: a single pass over the entire capture
+** list computing, for each back reference, the index of the group
+** capture that 'findback' would find for it (or NOBACKREF if there is
+** none, or NOINDEX if its name is not indexable). Groups visible from
+** a given capture are the ones that precede it in the list and are not
+** nested in other captures that also precede it; so, a table maps each
+** group name to the index of the last visible group with that name,
+** and entries added while inside a capture are undone when that capture
+** closes.
+*/
+#define NOBACKREF	(-1)
+#define NOINDEX		(-2)
+
+static void resolvebackrefs (CapState *cs) {
   lua_State *L = cs->L;
-  int n = 0;
-  lua_newtable(L);
-  if (isfullcap(cs->cap++))
-    return 1;  /* table is empty */
-  while (!isclosecap(cs->cap)) {
-    if (captype(cs->cap) == Cgroup && cs->cap->idx != 0) {  /* named group? */
-      pushluaval(cs);  /* push group name */
-      pushonenestedvalue(cs);
-      lua_settable(L, -3);
+  Capture *ocap = cs->ocap;
+  int n = caplistsize(ocap);
+  int *target, *undo, *scope;
+  int i, nundo = 0, nscope = 0;
+  int ktable = ktableidx(cs->ptop);
+  target = (int *)lua_newuserdata(L, (5 * n + 1) * sizeof(int));
+  lua_replace(L, cs->backrefidx);  /* anchor it */
+  undo = target + n;  /* pairs (group, previous group with that name) */
+  scope = undo + 2 * n;  /* pairs (open capture, size of 'undo' there) */
+  lua_newtable(L);  /* index: group name -> last visible group */
+  for (i = 0; i < n; i++) {
+    Capture *cap = ocap + i;
+    int g = i;  /* group capture that may become visible */
+    if (isclosecap(cap)) {  /* leaving a capture? */
+      int u = scope[2 * --nscope + 1];
+      while (nundo > u) {  /* undo entries added inside that capture */
+        nundo--;
+        lua_rawgeti(L, ktable, ocap[undo[2 * nundo]].idx);  /* name */
+        if (undo[2 * nundo + 1] == NOBACKREF)
+          lua_pushnil(L);
+        else
+          lua_pushinteger(L, undo[2 * nundo + 1]);
+        lua_rawset(L, -3);
+      }
+      g = scope[2 * nscope];  /* capture just closed */
     }
-    else {  /* not a named group */
-      int i;
-      int k = pushcapture(cs);
-      for (i = k; i > 0; i--)  /* store all values into table */
-        lua_rawseti(L, -(i + 1), n + i);
-      n += k;
+    else if (!isfullcap(cap)) {  /* entering a capture? */
+      scope[2 * nscope] = i;
+      scope[2 * nscope++ + 1] = nundo;
+      continue;
+    }
+    else if (captype(cap) == Cbackref) {
+      lua_rawgeti(L, ktable, cap->idx);  /* reference name */
+      if (!indexablename(L))
+        target[i] = NOINDEX;
+      else {
+        lua_rawget(L, -2);
+        target[i] = lua_isnil(L, -1) ? NOBACKREF : (int)lua_tointeger(L, -1);
+      }
+      lua_pop(L, 1);
+      continue;
+    }
+    cap = ocap + g;
+    if (captype(cap) == Cgroup && cap->idx != 0) {  /* completed group? */
+      lua_rawgeti(L, ktable, cap->idx);  /* group name */
+      if (!indexablename(L))
+        lua_pop(L, 1);
+      else {
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);  /* previous visible group with that name */
+        undo[2 * nundo] = g;
+        undo[2 * nundo + 1] = lua_isnil(L, -1) ? NOBACKREF
+                                               : (int)lua_tointeger(L, -1);
+        nundo++;
+        lua_pop(L, 1);
+        lua_pushinteger(L, g);
+        lua_rawset(L, -3);
+      }
     }
   }
-  cs->cap++;  /* skip close entry */
-  return 1;  /* number of values pushed (only the table) */
+  lua_pop(L, 1);  /* remove index */
+  cs->backrefs = target;
 }
 
 
 /*
-** Table-query capture
+** Find the named group referred by the back reference 'cap'
 */
-static int querycap (CapState *cs) {
-  int idx = cs->cap->idx;
-  pushonenestedvalue(cs);  /* get nested capture */
-  lua_gettable(cs->L, updatecache(cs, idx));  /* query cap. value at table */
-  if (!lua_isnil(cs->L, -1))
-    return 1;
-  else {  /* no value */
-    lua_pop(cs->L, 1);  /* remove nil */
-    return 0;
-  }
+static Capture *getbackref (CapState *cs, Capture *cap) {
+  int t = NOINDEX;
+  if (cs->backrefs == NULL && cs->backrefidx != 0)  /* not resolved yet? */
+    resolvebackrefs(cs);
+  if (cs->backrefs != NULL)
+    t = cs->backrefs[cap - cs->ocap];
+  pushluaval(cs);  /* reference name */
+  if (t == NOINDEX)  /* cannot use the index? */
+    return findback(cs, cap);  /* do a linear search */
+  else if (t == NOBACKREF)
+    luaL_error(cs->L, "back reference '%s' not found", lua_tostring(cs->L, -1));
+  lua_pop(cs->L, 1);  /* remove reference name */
+  return cs->ocap + t;
 }
 
 
 /*
-** Fold capture
+** Capture-shape analysis: a single pass over the entire capture list
+** computing, for each table capture, how many positional values
+** ('narr') and how many named groups ('nrec') its nested captures
+** produce. The counts for the capture at index 'i' go to 'shape[2*i]'
+** and 'shape[2*i + 1]'; for captures other than tables, 'shape[2*i]'
+** is used to accumulate the number of values of their nested captures.
+** Captures whose number of values depends on run-time information
+** (function, back reference) count as one value: the counts are only
+** hints for 'lua_createtable'.
 */
-static int foldcap (CapState *cs) {
-  int n;
+static void captureshape (CapState *cs) {
   lua_State *L = cs->L;
-  int idx = cs->cap->idx;
-  if (isfullcap(cs->cap++) ||  /* no nested captures? */
-      isclosecap(cs->cap) ||  /* no nested captures (large subject)? */
-      (n = pushcapture(cs)) == 0)  /* nested captures with no values? */
-    return luaL_error(L, "no initial value for fold capture");
-  if (n > 1)
-    lua_pop(L, n - 1);  /* leave only one result for accumulator */
-  while (!isclosecap(cs->cap)) {
-    lua_pushvalue(L, updatecache(cs, idx));  /* get folding function */
-    lua_insert(L, -2);  /* put it before accumulator */
-    n = pushcapture(cs);  /* get next capture's values */
-    lua_call(L, n + 1, 1);  /* call folding function */
+  Capture *ocap = cs->ocap;
+  int *shape, *stack;  /* 'stack' keeps indices of pending open captures */
+  int n = caplistsize(ocap);
+  int i, top = 0;
+  shape = (int *)lua_newuserdata(L, (3 * n + 1) * sizeof(int));
+  lua_replace(L, cs->shapeidx);  /* anchor it */
+  stack = shape + 2 * n;
+  for (i = 0; i < n; i++) {
+    Capture *cap = ocap + i;
+    int v;  /* number of values produced by capture 'cap' */
+    if (isclosecap(cap)) {  /* closing a capture: compute its values */
+      int nested;
+      cap = ocap + stack[--top];  /* corresponding open capture */
+      nested = shape[2 * (cap - ocap)];  /* values of nested captures */
+      switch (captype(cap)) {
+        case Csimple: v = nested + 1; break;  /* whole match plus nested */
+        case Cgroup: v = (nested == 0) ? 1 : nested; break;
+        case Cnum: v = (cap->idx != 0); break;
+        default: v = 1; break;
+      }
+    }
+    else {
+      shape[2 * i] = shape[2 * i + 1] = 0;
+      if (!isfullcap(cap)) {  /* open capture? */
+        stack[top++] = i;  /* its values will be known at its close */
+        continue;
+      }
+      v = (captype(cap) == Cnum && cap->idx == 0) ? 0 : 1;
+    }
+    if (top > 0) {  /* add values of 'cap' to enclosing capture */
+      int enc = stack[top - 1];
+      if (captype(cap) == Cgroup && cap->idx != 0) {  /* named group? */
+        if (captype(ocap + enc) == Ctable)
+          shape[2 * enc + 1]++;  /* it goes into the hash part */
+      }
+      else
+        shape[2 * enc] += v;
+    }
   }
-  cs->cap++;  /* skip close entry */
-  return 1;  /* only accumulator left on the stack */
+  cs->shape = shape;
 }
 
 
 /*
-** Function capture
+** {======================================================
+** Evaluation frames
+** =======================================================
 */
-static int functioncap (CapState *cs) {
-  int n;
-  int top = lua_gettop(cs->L);
-  pushluaval(cs);  /* push function */
-  n = pushnestedvalues(cs, 0);  /* push nested captures */
-  lua_call(cs->L, n, LUA_MULTRET);  /* call function */
-  return lua_gettop(cs->L) - top;  /* return function's results */
+
+/*
+** The evaluation of captures does not recurse over nested captures:
+** each composite capture being evaluated has a frame in 'cs->frames',
+** and the values it has collected so far are on the Lua stack, above
+** 'base'. A frame is opened when its open entry is reached and closed
+** when its close entry is reached, at which point the values of the
+** capture are computed and given to the enclosing frame.
+*/
+
+/* pseudo-kind for frames of named groups inside table captures */
+#define Cfield		(Cgroup + 1)
+
+
+/*
+** Maximum number of evaluation frames (see 'lpeg.setmaxcapdepth'),
+** read once when an evaluation starts
+*/
+static int getmaxcapdepth (lua_State *L) {
+  int max;
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXCAPDEPTHIDX);
+  max = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return max;
+}
+
+
+/*
+** Double the size of the stack of evaluation frames (up to its maximum)
+*/
+static void doubleframes (CapState *cs) {
+  lua_State *L = cs->L;
+  CapFrame *newframes;
+  int newn = 2 * cs->fsize;  /* new size */
+  if (newn > cs->fmax) newn = cs->fmax;
+  newframes = (CapFrame *)lua_newuserdata(L, newn * sizeof(CapFrame));
+  memcpy(newframes, cs->frames, cs->ftop * sizeof(CapFrame));
+  lua_replace(L, cs->frameidx);  /* anchor new frames (old ones are free) */
+  cs->frames = newframes;
+  cs->fsize = newn;
 }
 
 
 /*
-** Select capture
+** Finish the evaluation of the capture at the top frame; 'e' is the
+** end of its match. Returns the number of values it produced (which
+** replace the values it collected on the stack).
 */
-static int numcap (CapState *cs) {
-  int idx = cs->cap->idx;  /* value to select */
-  if (idx == 0) {  /* no values? */
-    nextcap(cs);  /* skip entire capture */
-    return 0;  /* no value produced */
+static int closeframe (CapState *cs, const char *e) {
+  lua_State *L = cs->L;
+  CapFrame *fr = &cs->frames[--cs->ftop];
+  const char *s = capsubj(cs, fr->open);  /* start of the match */
+  Capture *open = fr->open;
+  int n = lua_gettop(L) - fr->base;  /* number of nested values */
+  switch (fr->kind) {
+    case Ctable:  /* table is all that is left on the stack */
+      return 1;
+    case Cfold:
+      if (fr->n == 0)  /* no accumulator? */
+        return luaL_error(L, "no initial value for fold capture");
+      return 1;  /* only accumulator left on the stack */
+    case Csimple:
+      lua_pushlstring(L, s, e - s);  /* push whole match */
+      lua_insert(L, -(n + 1));  /* make whole match be first result */
+      return n + 1;
+    default: break;
   }
-  else {
-    int n = pushnestedvalues(cs, 0);
-    if (n < idx)  /* invalid index? */
-      return luaL_error(cs->L, "no capture '%d'", idx);
-    else {
-      lua_pushvalue(cs->L, -(n - idx + 1));  /* get selected capture */
-      lua_replace(cs->L, -(n + 1));  /* put it in place of 1st capture */
-      lua_pop(cs->L, n - 1);  /* remove other captures */
+  if (n == 0) {  /* no nested values? */
+    lua_pushlstring(L, s, e - s);  /* push whole match */
+    n = 1;
+  }
+  switch (fr->kind) {
+    case Cfunction: {
+      int top = fr->base - 1;  /* stack top before the function */
+      lua_call(L, n, LUA_MULTRET);  /* call function */
+      return lua_gettop(L) - top;  /* return function's results */
+    }
+    case Cnum: {
+      int idx = open->idx;  /* value to select */
+      if (n < idx)  /* invalid index? */
+        return luaL_error(L, "no capture '%d'", idx);
+      lua_pushvalue(L, -(n - idx + 1));  /* get selected capture */
+      lua_replace(L, -(n + 1));  /* put it in place of 1st capture */
+      lua_pop(L, n - 1);  /* remove other captures */
       return 1;
     }
+    case Cquery: {
+      lua_pop(L, n - 1);  /* only first value */
+      lua_gettable(L, updatecache(cs, open->idx));  /* query value at table */
+      if (!lua_isnil(L, -1))
+        return 1;
+      lua_pop(L, 1);  /* no value: remove nil */
+      return 0;
+    }
+    case Cfield: {
+      lua_pop(L, n - 1);  /* only first value */
+      lua_settable(L, -3);  /* set field in enclosing table */
+      return 0;
+    }
+    case Cbackref:
+      cs->cap = fr->ret;  /* continue after the back reference */
+      return n;
+    default:  /* anonymous group */
+      return n;
+  }
+}
+
+
+/*
+** Open a new frame, of the given kind, for the capture at 'cs->cap'.
+** 'ret' is where evaluation continues after the frame is closed (only
+** for back references). If the capture is a full capture, it is closed
+** right away and the function returns its number of values; otherwise
+** returns -1.
+*/
+static int openframe (CapState *cs, int kind, Capture *ret) {
+  lua_State *L = cs->L;
+  Capture *open = cs->cap++;
+  CapFrame *fr;
+  if (cs->ftop >= cs->fmax)  /* already at maximum depth? */
+    luaL_error(L, "capture nesting too deep (current limit is %d)", cs->fmax);
+  if (cs->ftop >= cs->fsize)
+    doubleframes(cs);
+  fr = &cs->frames[cs->ftop++];
+  fr->open = open; fr->ret = ret;
+  fr->kind = kind; fr->n = 0;
+  switch (kind) {
+    case Cfunction:
+      getfromktable(cs, open->idx);  /* push function */
+      break;
+    case Cfield:
+      getfromktable(cs, open->idx);  /* push group name */
+      break;
+    case Ctable: {
+      int narr = 0, nrec = 0;
+      if (!isfullcap(open) && cs->shape == NULL && cs->shapeidx != 0)
+        captureshape(cs);  /* compute size hints */
+      if (cs->shape != NULL) {
+        narr = cs->shape[2 * (open - cs->ocap)];
+        nrec = cs->shape[2 * (open - cs->ocap) + 1];
+      }
+      lua_createtable(L, narr, nrec);
+      break;
+    }
+    default: break;
+  }
+  fr->base = lua_gettop(L);
+  if (isfullcap(open))  /* no nested captures? */
+    return closeframe(cs, closeaddr(cs, open));
+  return -1;
+}
+
+
+/*
+** Give the 'k' values on the top of the stack, produced by a nested
+** capture, to the capture at the top frame
+*/
+static void addtoframe (CapState *cs, int k) {
+  lua_State *L = cs->L;
+  CapFrame *fr = &cs->frames[cs->ftop - 1];
+  switch (fr->kind) {
+    case Ctable: {  /* store all values into table */
+      int i;
+      for (i = k; i > 0; i--)
+        lua_rawseti(L, -(i + 1), fr->n + i);
+      fr->n += k;
+      break;
+    }
+    case Cfold: {
+      if (fr->n == 0) {  /* first nested capture? */
+        if (k == 0)  /* nested captures with no values? */
+          luaL_error(L, "no initial value for fold capture");
+        lua_pop(L, k - 1);  /* leave only one result for accumulator */
+        fr->n = 1;
+      }
+      else {
+        lua_pushvalue(L, updatecache(cs, fr->open->idx));  /* function */
+        lua_insert(L, -(k + 2));  /* put it before accumulator */
+        lua_call(L, k + 1, 1);  /* call folding function */
+      }
+      break;
+    }
+    default:  /* values stay on the stack */
+      break;
   }
 }
 
+/* }====================================================== */
+
 
 /*
 ** Return the stack index of the first runtime capture in the given
@@ -271,26 +504,43 @@ int finddyncap (Capture *cap, Capture *last) {
 
 
 /*
-** Calls a runtime capture. Returns number of captures removed by
-** the call, including the initial Cgroup. (Captures to be added are
-** on the Lua stack.)
+** Prepares the call to a runtime capture: pushes the function and its
+** arguments. Returns the number of arguments.
 */
-int runtimecap (CapState *cs, Capture *close, const char *s, int *rem) {
-  int n, id;
+int pushruntimecap (CapState *cs, Capture *close, const char *s) {
+  int n;
+  CapFrame frames[INITCAPFRAMES];
   lua_State *L = cs->L;
-  int otop = lua_gettop(L);
   Capture *open = findopen(close);
   assert(captype(open) == Cgroup);
-  id = finddyncap(open, close);  /* get first dynamic capture argument */
   close->kind = Cclose;  /* closes the group */
-  close->s = s;
+  close->index = s - cs->s;
   cs->cap = open; cs->valuecached = 0;  /* prepare capture state */
-  luaL_checkstack(L, 4, "too many runtime captures");
+  cs->shape = NULL; cs->shapeidx = 0;  /* no size hints for tables */
+  cs->backrefs = NULL; cs->backrefidx = 0;  /* no index for back refs. */
+  cs->frames = frames; cs->ftop = 0; cs->fsize = INITCAPFRAMES;
+  cs->fmax = getmaxcapdepth(L);
+  cs->frameidx = lua_gettop(L) + 1; cs->strnest = 0;
+  luaL_checkstack(L, 5, "too many runtime captures");
+  lua_pushnil(L);  /* slot to anchor evaluation frames, if needed */
   pushluaval(cs);  /* push function to be called */
   lua_pushvalue(L, SUBJIDX);  /* push original subject */
   lua_pushinteger(L, s - cs->s + 1);  /* push current position */
-  n = pushnestedvalues(cs, 0);  /* push nested captures */
-  lua_call(L, n + 2, LUA_MULTRET);  /* call dynamic function */
+  n = pushnestedvalues(cs);  /* push nested captures */
+  lua_remove(L, cs->frameidx);  /* frames are not needed anymore */
+  return n + 2;
+}
+
+
+/*
+** Finishes the call to a runtime capture, whose results are above
+** stack index 'otop'. Returns number of captures removed by the call,
+** including the initial Cgroup. (Captures to be added are on the Lua
+** stack.)
+*/
+int closeruntimecap (lua_State *L, Capture *close, int otop, int *rem) {
+  Capture *open = findopen(close);
+  int id = finddyncap(open, close);  /* get first dynamic capture argument */
   if (id > 0) {  /* are there old dynamic captures to be removed? */
     int i;
     for (i = id; i <= otop; i++)
@@ -303,6 +553,20 @@ int runtimecap (CapState *cs, Capture *close, const char *s, int *rem) {
 }
 
 
+/*
+** Calls a runtime capture. Returns number of captures removed by
+** the call, including the initial Cgroup. (Captures to be added are
+** on the Lua stack.)
+*/
+int runtimecap (CapState *cs, Capture *close, const char *s, int *rem) {
+  lua_State *L = cs->L;
+  int otop = lua_gettop(L);
+  int n = pushruntimecap(cs, close, s);
+  lua_call(L, n, LUA_MULTRET);  /* call dynamic function */
+  return closeruntimecap(L, close, otop, rem);
+}
+
+
 /*
 ** Auxiliary structure for substitution and string captures: keep
 ** information about nested captures for future use, avoiding to push
@@ -330,7 +594,7 @@ typedef struct StrAux {
 static int getstrcaps (CapState *cs, StrAux *cps, int n) {
   int k = n++;
   cps[k].isstring = 1;  /* get string value */
-  cps[k].u.s.s = cs->cap->s;  /* starts here */
+  cps[k].u.s.s = capsubj(cs, cs->cap);  /* starts here */
   if (!isfullcap(cs->cap++)) {  /* nested captures? */
     while (!isclosecap(cs->cap)) {  /* traverse them */
       if (n >= MAXSTRCAPS)  /* too many captures? */
@@ -346,11 +610,20 @@ static int getstrcaps (CapState *cs, StrAux *cps, int n) {
     }
     cs->cap++;  /* skip close */
   }
-  cps[k].u.s.e = closeaddr(cs->cap - 1);  /* ends here */
+  cps[k].u.s.e = closeaddr(cs, cs->cap - 1);  /* ends here */
   return n;
 }
 
 
+/*
+** String and substitution captures are evaluated with C recursion
+** (each level with its own buffer), so their nesting is limited
+*/
+#define enterstrcap(cs)  \
+  { if (++(cs)->strnest > MAXSTRCAPNEST)  \
+      luaL_error((cs)->L, "string captures nested too deep"); }
+
+
 /*
 ** add next capture value (which should be a string) to buffer 'b'
 */
@@ -366,6 +639,7 @@ static void stringcap (luaL_Buffer *b, CapState *cs) {
   int n;
   size_t len, i;
   const char *fmt;  /* format string */
+  enterstrcap(cs);
   fmt = lua_tolstring(cs->L, updatecache(cs, cs->cap->idx), &len);
   n = getstrcaps(cs, cps, 0) - 1;  /* collect nested captures */
   for (i = 0; i < len; i++) {  /* traverse them */
@@ -388,6 +662,7 @@ static void stringcap (luaL_Buffer *b, CapState *cs) {
       }
     }
   }
+  cs->strnest--;
 }
 
 
@@ -395,22 +670,24 @@ static void stringcap (luaL_Buffer *b, CapState *cs) {
 ** Substitution capture: add result to buffer 'b'
 */
 static void substcap (luaL_Buffer *b, CapState *cs) {
-  const char *curr = cs->cap->s;
+  const char *curr = capsubj(cs, cs->cap);
+  enterstrcap(cs);
   if (isfullcap(cs->cap))  /* no nested captures? */
     luaL_addlstring(b, curr, cs->cap->siz - 1);  /* keep original text */
   else {
     cs->cap++;  /* skip open entry */
     while (!isclosecap(cs->cap)) {  /* traverse nested captures */
-      const char *next = cs->cap->s;
+      const char *next = capsubj(cs, cs->cap);
       luaL_addlstring(b, curr, next - curr);  /* add text up to capture */
       if (addonestring(b, cs, "replacement"))
-        curr = closeaddr(cs->cap - 1);  /* continue after match */
+        curr = closeaddr(cs, cs->cap - 1);  /* continue after match */
       else  /* no capture value */
         curr = next;  /* keep original text in final result */
     }
-    luaL_addlstring(b, curr, cs->cap->s - curr);  /* add last piece of text */
+    luaL_addlstring(b, curr, capsubj(cs, cs->cap) - curr);  /* last piece */
   }
   cs->cap++;  /* go to next capture */
+  cs->strnest--;
 }
 
 
@@ -442,15 +719,15 @@ static int addonestring (luaL_Buffer *b, CapState *cs, const char *what) {
 
 
 /*
-** Push all values of the current capture into the stack; returns
-** number of values pushed
+** Push the values of the capture at 'cs->cap', if it has no nested
+** captures to evaluate; otherwise, open a frame for it and return -1.
+** 'fbase' is the frame level where the current evaluation started.
 */
-static int pushcapture (CapState *cs) {
+static int startcap (CapState *cs, int fbase) {
   lua_State *L = cs->L;
-  luaL_checkstack(L, 4, "too many captures");
   switch (captype(cs->cap)) {
     case Cposition: {
-      lua_pushinteger(L, cs->cap->s - cs->s + 1);
+      lua_pushinteger(L, cs->cap->index + 1);
       cs->cap++;
       return 1;
     }
@@ -466,11 +743,6 @@ static int pushcapture (CapState *cs) {
       lua_pushvalue(L, arg + FIXEDARGS);
       return 1;
     }
-    case Csimple: {
-      int k = pushnestedvalues(cs, 1);
-      lua_insert(L, -k);  /* make whole match be first result */
-      return k;
-    }
     case Cruntime: {
       lua_pushvalue(L, (cs->cap++)->idx);  /* value is in the stack */
       return 1;
@@ -491,23 +763,78 @@ static int pushcapture (CapState *cs) {
     }
     case Cgroup: {
       if (cs->cap->idx == 0)  /* anonymous group? */
-        return pushnestedvalues(cs, 0);  /* add all nested values */
+        return openframe(cs, Cgroup, NULL);  /* add all nested values */
+      else if (cs->ftop > fbase && cs->frames[cs->ftop - 1].kind == Ctable)
+        return openframe(cs, Cfield, NULL);  /* named group in a table */
       else {  /* named group: add no values */
         nextcap(cs);  /* skip capture */
         return 0;
       }
     }
-    case Cbackref: return backrefcap(cs);
-    case Ctable: return tablecap(cs);
-    case Cfunction: return functioncap(cs);
-    case Cnum: return numcap(cs);
-    case Cquery: return querycap(cs);
-    case Cfold: return foldcap(cs);
+    case Cbackref: {
+      Capture *curr = cs->cap;
+      cs->cap = getbackref(cs, curr);  /* find corresponding group */
+      return openframe(cs, Cbackref, curr + 1);  /* push group's values */
+    }
+    case Cnum: {
+      if (cs->cap->idx == 0) {  /* no values? */
+        nextcap(cs);  /* skip entire capture */
+        return 0;  /* no value produced */
+      }
+      return openframe(cs, Cnum, NULL);
+    }
+    case Csimple: case Ctable: case Cfunction: case Cquery: case Cfold:
+      return openframe(cs, captype(cs->cap), NULL);
     default: assert(0); return 0;
   }
 }
 
 
+/*
+** Evaluate captures until the frame level goes back to 'fbase'. Returns
+** the number of values produced by the last capture closed at that level.
+*/
+static int evalcaptures (CapState *cs, int fbase) {
+  lua_State *L = cs->L;
+  for (;;) {
+    int k;  /* number of values produced by a capture */
+    luaL_checkstack(L, 4, "too many captures");
+    if (isclosecap(cs->cap)) {  /* end of capture at the top frame? */
+      assert(cs->ftop > fbase);
+      cs->cap++;  /* skip close entry */
+      k = closeframe(cs, capsubj(cs, cs->cap - 1));
+    }
+    else if ((k = startcap(cs, fbase)) < 0)  /* opened a new frame? */
+      continue;  /* go evaluate its nested captures */
+    if (cs->ftop == fbase)  /* back to the initial level? */
+      return k;
+    addtoframe(cs, k);  /* give the values to the enclosing capture */
+  }
+}
+
+
+/*
+** Push all values of the current capture into the stack; returns
+** number of values pushed
+*/
+static int pushcapture (CapState *cs) {
+  return evalcaptures(cs, cs->ftop);
+}
+
+
+/*
+** Push on the Lua stack all values generated by nested captures inside
+** the current capture. Returns number of values pushed. The entire
+** match is pushed if there are no other nested values, so the function
+** never returns zero.
+*/
+static int pushnestedvalues (CapState *cs) {
+  int fbase = cs->ftop;
+  int k = openframe(cs, Cgroup, NULL);
+  return (k >= 0) ? k : evalcaptures(cs, fbase);
+}
+
+
 /*
 ** Prepare a CapState structure and traverse the entire list of
 ** captures in the stack pushing its results. 's' is the subject
@@ -521,8 +848,14 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
   int n = 0;
   if (!isclosecap(capture)) {  /* is there any capture? */
     CapState cs;
+    CapFrame frames[INITCAPFRAMES];
     cs.ocap = cs.cap = capture; cs.L = L;
     cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+    cs.shape = NULL; cs.shapeidx = shapeidx(ptop);
+    cs.backrefs = NULL; cs.backrefidx = backrefidx(ptop);
+    cs.frames = frames; cs.ftop = 0; cs.fsize = INITCAPFRAMES;
+    cs.fmax = getmaxcapdepth(L);
+    cs.frameidx = frameidx(ptop); cs.strnest = 0;
     do {  /* collect their values */
       n += pushcapture(&cs);
     } while (!isclosecap(cs.cap));
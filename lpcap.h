@@ -16,18 +16,33 @@ typedef enum CapKind {
 } CapKind;
 
 
+/*
+** An unsigned integer large enough to index any subject entirely.
+** (It could be 'size_t', but that would make captures larger in 64-bit
+** machines.)
+*/
+#if !defined(Index_t)
+typedef unsigned int Index_t;
+#endif
+
+#define MAXINDT		(~(Index_t)0)
+
+
 typedef struct Capture {
-  const char *s;  /* subject position */
+  Index_t index;  /* subject position (offset from its start) */
+  Index_t siz;  /* size of full capture + 1 (0 = not a full capture) */
   unsigned short idx;  /* extra info (group name, arg index, etc.) */
   byte kind;  /* kind of capture */
-  byte siz;  /* size of full capture + 1 (0 = not a full capture) */
 } Capture;
 
-typedef struct CaptureStack {
-  int captop;
-  int dyncaptop;
-  int capsize;
-} CaptureStack;
+/* frame for a composite capture being evaluated */
+typedef struct CapFrame {
+  Capture *open;  /* open entry of the capture */
+  Capture *ret;  /* where to continue after it (back references only) */
+  int base;  /* stack top before its nested values */
+  int n;  /* number of values already stored (tables, folds) */
+  int kind;  /* kind of evaluation */
+} CapFrame;
 
 typedef struct CapState {
   Capture *cap;  /* current capture */
@@ -36,10 +51,22 @@ typedef struct CapState {
   int ptop;  /* index of last argument to 'match' */
   const char *s;  /* original string */
   int valuecached;  /* value stored in cache slot */
+  int *shape;  /* size hints for table captures (NULL if not computed) */
+  int shapeidx;  /* stack index to anchor 'shape' (0 if not available) */
+  int *backrefs;  /* group referred by each back reference (or NULL) */
+  int backrefidx;  /* stack index to anchor 'backrefs' (0 if not available) */
+  CapFrame *frames;  /* stack of frames for composite captures */
+  int ftop;  /* first free slot in 'frames' */
+  int fsize;  /* size of 'frames' */
+  int fmax;  /* maximum number of frames (see 'lpeg.setmaxcapdepth') */
+  int frameidx;  /* stack index to anchor 'frames' when it grows */
+  int strnest;  /* nesting level of string and substitution captures */
 } CapState;
 
 
 int runtimecap (CapState *cs, Capture *close, const char *s, int *rem);
+int pushruntimecap (CapState *cs, Capture *close, const char *s);
+int closeruntimecap (lua_State *L, Capture *close, int otop, int *rem);
 int getcaptures (lua_State *L, const char *s, const char *r, int ptop);
 int finddyncap (Capture *cap, Capture *last);
 
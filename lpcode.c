@@ -4,6 +4,7 @@
 */
 
 #include <limits.h>
+#include <string.h>
 
 
 #include "lua.h"
@@ -125,23 +126,118 @@ int tocharset (TTree *tree, Charset *cs) {
 }
 
 
+/*
+** Properties of the nodes of the tree being compiled, computed once,
+** children before parents, before code generation (see 'analyze').
+** The analyses below return a property as soon as they reach a node
+** where it is known. Recursive rules (left recursive or not) are
+** solved by iteration: a call to a rule still being analyzed uses the
+** rule's current approximation, starting from that of a rule that
+** always fails (as the seed of a left-recursive call); the pass repeats
+** until no approximation grows. (All properties are monotone in those
+** of the called rules, so the result is their least fixed point.) A
+** recursive call to a left-recursive rule is never nofail or headfail,
+** as it fails when it reenters the seed of the recursion.
+*/
+
+/* bits in 'NodeInfo.known' and 'NodeInfo.value' */
+#define Pnullable	0x01
+#define Pnofail		0x02
+#define Pheadfail	0x04
+#define Phascaptures	0x08
+#define Pfixedlen	0x10  /* (only in 'known') length is in 'len' */
+#define Pfirst		0x20  /* (only in 'known') first set in 'first' */
+#define Pall		0x3F
+
+/* values of 'NodeInfo.state' */
+#define ANnew		0  /* not analyzed yet (in this pass) */
+#define ANbusy		1  /* a rule body being analyzed */
+#define ANdone		2  /* analyzed */
+
+/* values of 'NodeInfo.rule' */
+#define RNone		0  /* not the body of a rule */
+#define RBody		1  /* body of a rule */
+#define RRead		2  /* body whose approximation was used in this pass */
+
+/* an unknown property (during the analysis) */
+#define UNKNOWN		(-2)
+
+typedef struct NodeInfo {
+  byte state;
+  byte rule;
+  byte known;  /* properties already known */
+  byte value;  /* values of the known properties */
+  int len;  /* fixed length (-1 if variable) */
+  int first;  /* index of its first set in 'firsts' (or -1) */
+} NodeInfo;
+
+
+/*
+** First set of a sequence or a choice: 'getfirst(t, fl, cs)' gives
+** 'cs = f + (fl * m)' and returns 'e'. (Every case of 'getfirst' has
+** that form.)
+*/
+typedef struct FirstInfo {
+  Charset f;
+  Charset m;
+  int e;
+} FirstInfo;
+
+
+struct Analysis {
+  TTree *root;  /* root of the tree being compiled */
+  NodeInfo *info;  /* one entry for each slot of the tree */
+  FirstInfo *firsts;
+  int nfirsts;  /* number of entries used in 'firsts' */
+  int *order;  /* nodes being analyzed (stack of 'analyzetree') */
+  int ntop;  /* number of entries used in 'order' */
+  int grown;  /* some approximation grew in this pass */
+};
+
+
+#define getinfo(an,t)	(&(an)->info[(t) - (an)->root])
+
+
+/*
+** If property 'prop' of 'tree' is known, put it in '*v' and return 1
+*/
+static int knownprop (const Analysis *an, TTree *tree, int prop, int *v) {
+  if (an != NULL) {
+    const NodeInfo *ni = getinfo(an, tree);
+    if (ni->known & prop) {
+      *v = ((ni->value & prop) != 0);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
 /*
 ** Check whether a pattern tree has captures
 */
-int hascaptures (TTree *tree) {
+int hascaptures (const Analysis *an, TTree *tree) {
+  int v;
  tailcall:
+  if (knownprop(an, tree, Phascaptures, &v)) return v;
   switch (tree->tag) {
     case TCapture: case TRunTime:
       return 1;
-    case TCall:
-      tree = sib2(tree); goto tailcall;  /* return hascaptures(sib2(tree)); */
+    case TCall: {  /* return hascaptures(sib1(sib2(tree))); */
+      int key = tree->key;
+      if (key == 0) return 0;  /* recursive call: nothing new there */
+      tree->key = 0;  /* mark call as being visited */
+      v = hascaptures(an, sib1(sib2(tree)));
+      tree->key = key;
+      return v;
+    }
     case TOpenCall: assert(0);
     default: {
       switch (numsiblings[tree->tag]) {
         case 1:  /* return hascaptures(sib1(tree)); */
           tree = sib1(tree); goto tailcall;
         case 2:
-          if (hascaptures(sib1(tree))) return 1;
+          if (hascaptures(an, sib1(tree))) return 1;
           /* else return hascaptures(sib2(tree)); */
           tree = sib2(tree); goto tailcall;
         default: assert(numsiblings[tree->tag] == 0); return 0;
@@ -169,8 +265,11 @@ int hascaptures (TTree *tree) {
 ** Run-time captures can do whatever they want, so the result
 ** is conservative.
 */
-int checkaux (TTree *tree, int pred) {
+int checkaux (const Analysis *an, TTree *tree, int pred) {
+  int v;
  tailcall:
+  if (knownprop(an, tree, (pred == PEnofail) ? Pnofail : Pnullable, &v))
+    return v;
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
     case TFalse: case TOpenCall:
@@ -189,18 +288,24 @@ int checkaux (TTree *tree, int pred) {
       /* else return checkaux(sib1(tree), pred); */
       tree = sib1(tree); goto tailcall;
     case TSeq:
-      if (!checkaux(sib1(tree), pred)) return 0;
+      if (!checkaux(an, sib1(tree), pred)) return 0;
       /* else return checkaux(sib2(tree), pred); */
       tree = sib2(tree); goto tailcall;
     case TChoice:
-      if (checkaux(sib2(tree), pred)) return 1;
+      if (checkaux(an, sib2(tree), pred)) return 1;
       /* else return checkaux(sib1(tree), pred); */
       tree = sib1(tree); goto tailcall;
-    case TCapture: case TGrammar: case TRule:
+    case TCapture: case TGrammar: case TRule: case TMemo:
       /* return checkaux(sib1(tree), pred); */
       tree = sib1(tree); goto tailcall;
-    case TCall:  /* return checkaux(sib2(tree), pred); */
-      tree = sib2(tree); goto tailcall;
+    case TCall: {  /* return checkaux(sib2(tree), pred); */
+      int key = tree->key;
+      if (key == 0) return 0;  /* recursive call: assume it fails */
+      tree->key = 0;  /* mark call as being visited */
+      v = checkaux(an, sib2(tree), pred);
+      tree->key = key;
+      return v;
+    }
     default: assert(0); return 0;
   }
 }
@@ -210,8 +315,12 @@ int checkaux (TTree *tree, int pred) {
 ** number of characters to match a pattern (or -1 if variable)
 ** ('count' avoids infinite loops for grammars)
 */
-int fixedlenx (TTree *tree, int count, int len) {
+int fixedlenx (const Analysis *an, TTree *tree, int count, int len) {
  tailcall:
+  if (an != NULL && (getinfo(an, tree)->known & Pfixedlen)) {
+    int n = getinfo(an, tree)->len;
+    return (n < 0) ? -1 : len + n;
+  }
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
       return len + 1;
@@ -219,7 +328,7 @@ int fixedlenx (TTree *tree, int count, int len) {
       return len;
     case TRep: case TRunTime: case TOpenCall:
       return -1;
-    case TCapture: case TRule: case TGrammar:
+    case TCapture: case TRule: case TGrammar: case TMemo:
       /* return fixedlenx(sib1(tree), count); */
       tree = sib1(tree); goto tailcall;
     case TCall:
@@ -228,16 +337,16 @@ int fixedlenx (TTree *tree, int count, int len) {
       /* else return fixedlenx(sib2(tree), count); */
       tree = sib2(tree); goto tailcall;
     case TSeq: {
-      len = fixedlenx(sib1(tree), count, len);
+      len = fixedlenx(an, sib1(tree), count, len);
       if (len < 0) return -1;
       /* else return fixedlenx(sib2(tree), count, len); */
       tree = sib2(tree); goto tailcall;
     }
     case TChoice: {
       int n1, n2;
-      n1 = fixedlenx(sib1(tree), count, len);
+      n1 = fixedlenx(an, sib1(tree), count, len);
       if (n1 < 0) return -1;
-      n2 = fixedlenx(sib2(tree), count, len);
+      n2 = fixedlenx(an, sib2(tree), count, len);
       if (n1 == n2) return n1;
       else return -1;
     }
@@ -264,8 +373,14 @@ int fixedlenx (TTree *tree, int count, int len) {
 ** 2) there is a match-time capture ==> return has bit 2 set
 ** (optimizations should not bypass match-time captures).
 */
-static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
+static int getfirst (const Analysis *an, TTree *tree, const Charset *follow,
+                     Charset *firstset) {
  tailcall:
+  if (an != NULL && (getinfo(an, tree)->known & Pfirst)) {  /* cached? */
+    const FirstInfo *fi = &an->firsts[getinfo(an, tree)->first];
+    loopset(i, firstset->cs[i] = fi->f.cs[i] | (follow->cs[i] & fi->m.cs[i]));
+    return fi->e;
+  }
   switch (tree->tag) {
     case TChar: case TSet: case TAny: {
       tocharset(tree, firstset);
@@ -281,21 +396,21 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
     }
     case TChoice: {
       Charset csaux;
-      int e1 = getfirst(sib1(tree), follow, firstset);
-      int e2 = getfirst(sib2(tree), follow, &csaux);
+      int e1 = getfirst(an, sib1(tree), follow, firstset);
+      int e2 = getfirst(an, sib2(tree), follow, &csaux);
       loopset(i, firstset->cs[i] |= csaux.cs[i]);
       return e1 | e2;
     }
     case TSeq: {
-      if (!nullable(sib1(tree))) {
+      if (!checkaux(an, sib1(tree), PEnullable)) {
         /* when p1 is not nullable, p2 has nothing to contribute;
            return getfirst(sib1(tree), fullset, firstset); */
         tree = sib1(tree); follow = fullset; goto tailcall;
       }
       else {  /* FIRST(p1 p2, fl) = FIRST(p1, FIRST(p2, fl)) */
         Charset csaux;
-        int e2 = getfirst(sib2(tree), follow, &csaux);
-        int e1 = getfirst(sib1(tree), &csaux, firstset);
+        int e2 = getfirst(an, sib2(tree), follow, &csaux);
+        int e1 = getfirst(an, sib1(tree), &csaux, firstset);
         if (e1 == 0) return 0;  /* 'e1' ensures that first can be used */
         else if ((e1 | e2) & 2)  /* one of the children has a matchtime? */
           return 2;  /* pattern has a matchtime capture */
@@ -303,16 +418,16 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       }
     }
     case TRep: {
-      getfirst(sib1(tree), follow, firstset);
+      getfirst(an, sib1(tree), follow, firstset);
       loopset(i, firstset->cs[i] |= follow->cs[i]);
       return 1;  /* accept the empty string */
     }
-    case TCapture: case TGrammar: case TRule: {
+    case TCapture: case TGrammar: case TRule: case TMemo: {
       /* return getfirst(sib1(tree), follow, firstset); */
       tree = sib1(tree); goto tailcall;
     }
     case TRunTime: {  /* function invalidates any follow info. */
-      int e = getfirst(sib1(tree), fullset, firstset);
+      int e = getfirst(an, sib1(tree), fullset, firstset);
       if (e) return 2;  /* function is not "protected"? */
       else return 0;  /* pattern inside capture ensures first can be used */
     }
@@ -321,7 +436,7 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       tree = sib2(tree); goto tailcall;
     }
     case TAnd: {
-      int e = getfirst(sib1(tree), follow, firstset);
+      int e = getfirst(an, sib1(tree), follow, firstset);
       loopset(i, firstset->cs[i] &= follow->cs[i]);
       return e;
     }
@@ -330,11 +445,11 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
         cs_complement(firstset);
         return 1;
       }
-      /* else go through */
     }
+    /* else fall through */
     case TBehind: {  /* instruction gives no new information */
       /* call 'getfirst' only to check for math-time captures */
-      int e = getfirst(sib1(tree), follow, firstset);
+      int e = getfirst(an, sib1(tree), follow, firstset);
       loopset(i, firstset->cs[i] = follow->cs[i]);  /* uses follow */
       return e | 1;  /* always can accept the empty string */
     }
@@ -347,24 +462,26 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
 ** If 'headfail(tree)' true, then 'tree' can fail only depending on the
 ** next character of the subject.
 */
-static int headfail (TTree *tree) {
+static int headfail (const Analysis *an, TTree *tree) {
+  int v;
  tailcall:
+  if (knownprop(an, tree, Pheadfail, &v)) return v;
   switch (tree->tag) {
     case TChar: case TSet: case TAny: case TFalse:
       return 1;
     case TTrue: case TRep: case TRunTime: case TNot:
     case TBehind:
       return 0;
-    case TCapture: case TGrammar: case TRule: case TAnd:
+    case TCapture: case TGrammar: case TRule: case TAnd: case TMemo:
       tree = sib1(tree); goto tailcall;  /* return headfail(sib1(tree)); */
     case TCall:
       tree = sib2(tree); goto tailcall;  /* return headfail(sib2(tree)); */
     case TSeq:
-      if (!nofail(sib2(tree))) return 0;
+      if (!checkaux(an, sib2(tree), PEnofail)) return 0;
       /* else return headfail(sib1(tree)); */
       tree = sib1(tree); goto tailcall;
     case TChoice:
-      if (!headfail(sib1(tree))) return 0;
+      if (!headfail(an, sib1(tree))) return 0;
       /* else return headfail(sib2(tree)); */
       tree = sib2(tree); goto tailcall;
     default: assert(0); return 0;
@@ -382,11 +499,11 @@ static int needfollow (TTree *tree) {
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
     case TFalse: case TTrue: case TAnd: case TNot:
-    case TRunTime: case TGrammar: case TCall: case TBehind:
+    case TRunTime: case TGrammar: case TBehind:
       return 0;
-    case TChoice: case TRep:
+    case TChoice: case TRep: case TCall:  /* (a call may be inlined) */
       return 1;
-    case TCapture:
+    case TCapture: case TMemo:
       tree = sib1(tree); goto tailcall;
     case TSeq:
       tree = sib2(tree); goto tailcall;
@@ -394,26 +511,573 @@ static int needfollow (TTree *tree) {
   } 
 }
 
+/* }====================================================== */
+
+
 /*
-** Check whether a pattern tree has left recursion
+** {======================================================
+** Bottom-up pass computing the cache of the analyses
+** =======================================================
 */
-int hasleftrecursion (TTree *tree) {
- tailcall:
-  switch (tree->tag) {
-    case TCall:
-      return tree->lr;
+
+/* property 'prop' of an analyzed node (or UNKNOWN) */
+static int getprop (const Analysis *an, TTree *t, int prop) {
+  const NodeInfo *ni = getinfo(an, t);
+  if (!(ni->known & prop)) return UNKNOWN;
+  else return ((ni->value & prop) != 0);
+}
+
+
+static int getlen (const Analysis *an, TTree *t) {
+  const NodeInfo *ni = getinfo(an, t);
+  return (ni->known & Pfixedlen) ? ni->len : UNKNOWN;
+}
+
+
+static void setprop (NodeInfo *ni, int prop, int v) {
+  if (v != UNKNOWN) {
+    ni->known |= prop;
+    if (v) ni->value |= prop;
+  }
+}
+
+
+/* 'a && b', evaluating 'a' first (as in 'checkaux' for sequences) */
+static int andprop (int a, int b) {
+  if (a == UNKNOWN) return UNKNOWN;
+  else return a ? b : 0;
+}
+
+
+/* 'a || b', evaluating 'a' first */
+static int orprop (int a, int b) {
+  if (a == UNKNOWN) return UNKNOWN;
+  else return a ? 1 : b;
+}
+
+
+/* entry in 'firsts' for node 'ni' (allocated in its first use) */
+static FirstInfo *firstentry (Analysis *an, NodeInfo *ni) {
+  if (ni->first < 0)
+    ni->first = an->nfirsts++;
+  return &an->firsts[ni->first];
+}
+
+
+/*
+** First set of 't' in the form of 'FirstInfo' (see 'getfirst'), from
+** the first sets already computed for sequences, choices and rule
+** bodies; returns 'e' or UNKNOWN
+*/
+static int firstof (const Analysis *an, TTree *t, Charset *f, Charset *m) {
+  int e;
+  switch (t->tag) {
+    case TChar: case TSet: case TAny: {
+      tocharset(t, f);
+      loopset(i, m->cs[i] = 0);
+      return 0;
+    }
+    case TTrue: case TFalse: {
+      loopset(i, f->cs[i] = 0);
+      loopset(i, m->cs[i] = (t->tag == TTrue) ? 0xFF : 0);
+      return (t->tag == TTrue);
+    }
+    case TSeq: case TChoice: {
+      const NodeInfo *ni = getinfo(an, t);
+      if (!(ni->known & Pfirst)) return UNKNOWN;
+      *f = an->firsts[ni->first].f;
+      *m = an->firsts[ni->first].m;
+      return an->firsts[ni->first].e;
+    }
+    case TCall: {  /* body of the rule (or its approximation) */
+      const NodeInfo *ni = getinfo(an, sib1(sib2(t)));
+      if (!(ni->known & Pfirst)) return UNKNOWN;
+      *f = an->firsts[ni->first].f;
+      *m = an->firsts[ni->first].m;
+      return an->firsts[ni->first].e;
+    }
+    case TCapture: case TGrammar: case TRule: case TMemo:
+      return firstof(an, sib1(t), f, m);
+    case TRep: {  /* first(p1, fl) + fl */
+      if ((e = firstof(an, sib1(t), f, m)) == UNKNOWN) return UNKNOWN;
+      loopset(i, m->cs[i] = 0xFF);
+      return 1;
+    }
+    case TRunTime: {  /* first(p1, fullset) */
+      if ((e = firstof(an, sib1(t), f, m)) == UNKNOWN) return UNKNOWN;
+      loopset(i, f->cs[i] |= m->cs[i]; m->cs[i] = 0);
+      return e ? 2 : 0;
+    }
+    case TAnd: {  /* first(p1, fl) * fl */
+      if ((e = firstof(an, sib1(t), f, m)) == UNKNOWN) return UNKNOWN;
+      loopset(i, m->cs[i] |= f->cs[i]; f->cs[i] = 0);
+      return e;
+    }
+    case TNot: {
+      if (tocharset(sib1(t), f)) {
+        cs_complement(f);
+        loopset(i, m->cs[i] = 0);
+        return 1;
+      }
+    }
+    /* else fall through */
+    case TBehind: {  /* fl */
+      if ((e = firstof(an, sib1(t), f, m)) == UNKNOWN) return UNKNOWN;
+      loopset(i, f->cs[i] = 0; m->cs[i] = 0xFF);
+      return e | 1;
+    }
+    default: return UNKNOWN;
+  }
+}
+
+
+/*
+** Compute the first set of 't', a sequence or a choice (whose children
+** were already analyzed) or the body of a rule, if it does not depend
+** on unknown properties
+*/
+static void firstnode (Analysis *an, TTree *t) {
+  FirstInfo fi;
+  Charset f2, m2;
+  int e1, e2;
+  if (t->tag != TSeq && t->tag != TChoice) {
+    if ((fi.e = firstof(an, t, &fi.f, &fi.m)) == UNKNOWN)
+      return;
+  }
+  else if ((e1 = firstof(an, sib1(t), &fi.f, &fi.m)) == UNKNOWN)
+    return;
+  else if (t->tag == TSeq) {
+    int n1 = getprop(an, sib1(t), Pnullable);
+    if (n1 == UNKNOWN)
+      return;
+    else if (!n1) {  /* first(p1, fullset) */
+      loopset(i, fi.f.cs[i] |= fi.m.cs[i]; fi.m.cs[i] = 0);
+      fi.e = e1;
+    }
+    else {  /* first(p1, first(p2, fl)) */
+      if ((e2 = firstof(an, sib2(t), &f2, &m2)) == UNKNOWN)
+        return;
+      loopset(i, fi.f.cs[i] |= fi.m.cs[i] & f2.cs[i];
+                 fi.m.cs[i] &= m2.cs[i]);
+      if (e1 == 0) fi.e = 0;
+      else if ((e1 | e2) & 2) fi.e = 2;
+      else fi.e = e2;
+    }
+  }
+  else {  /* first(p1, fl) + first(p2, fl) */
+    if ((e2 = firstof(an, sib2(t), &f2, &m2)) == UNKNOWN)
+      return;
+    loopset(i, fi.f.cs[i] |= f2.cs[i]; fi.m.cs[i] |= m2.cs[i]);
+    fi.e = e1 | e2;
+  }
+  *firstentry(an, getinfo(an, t)) = fi;
+  getinfo(an, t)->known |= Pfirst;
+}
+
+
+static void analyzetree (Analysis *an, TTree *tree);
+
+
+/*
+** Analyze the body of a rule, if not analyzed yet in this pass; while
+** it is being analyzed, calls to the rule use its approximation (the
+** result of the previous pass, or a rule that always fails). If that
+** approximation was used, the new result is joined to it (so that
+** approximations only grow), and any growth asks for another pass.
+*/
+static TTree *analyzerule (Analysis *an, TTree *rule) {
+  TTree *body = sib1(rule);
+  NodeInfo *ni = getinfo(an, body);
+  if (ni->state == ANnew) {
+    NodeInfo old;
+    FirstInfo oldfirst, *fi;
+    if (ni->rule == RNone) {  /* first visit? */
+      ni->rule = RBody;
+      ni->known = Pall; ni->value = 0; ni->len = -1;
+      fi = firstentry(an, ni);
+      loopset(i, fi->f.cs[i] = 0; fi->m.cs[i] = 0);
+      fi->e = 0;
+    }
+    old = *ni; oldfirst = an->firsts[ni->first];
+    ni->state = ANbusy;
+    analyzetree(an, body);
+    if (ni->rule == RRead) {  /* was the approximation used? */
+      fi = &an->firsts[ni->first];
+      ni->value |= old.value;  /* join results */
+      ni->known = Pall;
+      ni->len = -1;
+      loopset(i, fi->f.cs[i] |= oldfirst.f.cs[i];
+                 fi->m.cs[i] |= oldfirst.m.cs[i]);
+      fi->e |= oldfirst.e;
+      if (ni->value != old.value || fi->e != oldfirst.e ||
+          !cs_equal(fi->f.cs, oldfirst.f.cs) ||
+          !cs_equal(fi->m.cs, oldfirst.m.cs))
+        an->grown = 1;
+    }
+  }
+  else if (ni->state == ANbusy)  /* recursive call */
+    ni->rule = RRead;
+  return body;
+}
+
+
+/*
+** Compute the properties of node 't', whose children were already
+** analyzed (following the cases of the analyses above)
+*/
+static void analyzenode (Analysis *an, TTree *t) {
+  NodeInfo *ni = getinfo(an, t);
+  int nl = UNKNOWN, nf = UNKNOWN, hf = UNKNOWN, len = UNKNOWN;
+  int caps;
+  switch (t->tag) {
+    case TChar: case TSet: case TAny:
+      nl = nf = 0; hf = 1; len = 1; break;
+    case TFalse:
+      nl = nf = 0; hf = 1; len = 0; break;
+    case TTrue:
+      nl = nf = 1; hf = 0; len = 0; break;
+    case TRep:
+      nl = nf = 1; hf = 0; len = -1; break;
+    case TNot: case TBehind:
+      nl = 1; nf = hf = 0; len = 0; break;
+    case TOpenCall:
+      nl = nf = 0; len = -1; break;
+    case TAnd:
+      nl = 1; len = 0;
+      nf = getprop(an, sib1(t), Pnofail);
+      hf = getprop(an, sib1(t), Pheadfail);
+      break;
+    case TRunTime:
+      nl = getprop(an, sib1(t), Pnullable);
+      nf = hf = 0; len = -1;
+      break;
+    case TRule:
+      analyzerule(an, t);
+      /* FALLTHROUGH */
+    case TCapture: case TGrammar: case TMemo:
+      nl = getprop(an, sib1(t), Pnullable);
+      nf = getprop(an, sib1(t), Pnofail);
+      hf = getprop(an, sib1(t), Pheadfail);
+      len = getlen(an, sib1(t));
+      break;
+    case TCall: {
+      TTree *body = analyzerule(an, sib2(t));
+      nl = getprop(an, body, Pnullable);
+      if (t->lr && getinfo(an, body)->state == ANbusy)
+        nf = hf = 0;  /* may reenter the seed of the left recursion */
+      else {
+        nf = getprop(an, body, Pnofail);
+        hf = getprop(an, body, Pheadfail);
+      }
+      len = getlen(an, body);
+      break;
+    }
+    case TSeq: {
+      int l1 = getlen(an, sib1(t));
+      int l2 = getlen(an, sib2(t));
+      nl = andprop(getprop(an, sib1(t), Pnullable),
+                   getprop(an, sib2(t), Pnullable));
+      nf = andprop(getprop(an, sib1(t), Pnofail),
+                   getprop(an, sib2(t), Pnofail));
+      hf = andprop(getprop(an, sib2(t), Pnofail),
+                   getprop(an, sib1(t), Pheadfail));
+      if (l1 == UNKNOWN || l1 < 0) len = l1;
+      else if (l2 == UNKNOWN || l2 < 0) len = l2;
+      else len = l1 + l2;
+      break;
+    }
+    case TChoice: {
+      int l1 = getlen(an, sib1(t));
+      int l2 = getlen(an, sib2(t));
+      nl = orprop(getprop(an, sib2(t), Pnullable),
+                  getprop(an, sib1(t), Pnullable));
+      nf = orprop(getprop(an, sib2(t), Pnofail),
+                  getprop(an, sib1(t), Pnofail));
+      hf = andprop(getprop(an, sib1(t), Pheadfail),
+                   getprop(an, sib2(t), Pheadfail));
+      if (l1 == UNKNOWN || l1 < 0) len = l1;
+      else if (l2 == UNKNOWN) len = l2;
+      else len = (l1 == l2) ? l1 : -1;
+      break;
+    }
+    default: assert(0);
+  }
+  switch (t->tag) {  /* captures */
+    case TCapture: case TRunTime: caps = 1; break;
+    case TCall: caps = getprop(an, sib1(sib2(t)), Phascaptures); break;
+    case TOpenCall: caps = UNKNOWN; break;
     default: {
-      switch (numsiblings[tree->tag]) {
-        case 1:  /* return hasleftrecursion(sib1(tree)); */
-          tree = sib1(tree); goto tailcall;
+      switch (numsiblings[t->tag]) {
+        case 1: caps = getprop(an, sib1(t), Phascaptures); break;
         case 2:
-          if (hasleftrecursion(sib1(tree))) return 1;
-          /* else return hasleftrecursion(sib2(tree)); */
-          tree = sib2(tree); goto tailcall;
-        default: assert(numsiblings[tree->tag] == 0); return 0;
+          caps = orprop(getprop(an, sib1(t), Phascaptures),
+                        getprop(an, sib2(t), Phascaptures));
+          break;
+        default: caps = 0; break;
       }
     }
   }
+  setprop(ni, Pnullable, nl);
+  setprop(ni, Pnofail, nf);
+  setprop(ni, Pheadfail, hf);
+  setprop(ni, Phascaptures, caps);
+  if (len != UNKNOWN) {
+    ni->known |= Pfixedlen;
+    ni->len = len;
+  }
+  if (t->tag == TSeq || t->tag == TChoice || ni->rule != RNone)
+    firstnode(an, t);
+  ni->state = ANdone;
+}
+
+
+/*
+** Analyze the nodes of 'tree' not analyzed yet, children before
+** parents. Rule bodies are analyzed apart (see 'analyzerule'), when
+** their rules or calls to them are analyzed; so, each node is in
+** 'order' at most once.
+*/
+static void analyzetree (Analysis *an, TTree *tree) {
+  int base = an->ntop;
+  int i;
+  an->order[an->ntop++] = tree - an->root;
+  for (i = base; i < an->ntop; i++) {  /* collect nodes, parents first */
+    TTree *t = an->root + an->order[i];
+    switch (numsiblings[t->tag]) {
+      case 2:
+        if (getinfo(an, sib2(t))->state == ANnew)
+          an->order[an->ntop++] = sib2(t) - an->root;
+        /* FALLTHROUGH */
+      case 1:
+        if (t->tag != TRule && getinfo(an, sib1(t))->state == ANnew)
+          an->order[an->ntop++] = sib1(t) - an->root;
+        break;
+      default: break;
+    }
+  }
+  while (an->ntop > base)  /* analyze them, children first */
+    analyzenode(an, an->root + an->order[--an->ntop]);
+}
+
+
+/*
+** Analyze pattern tree 'tree', with 'size' slots. The memory for
+** the analysis is a userdata left on the stack.
+*/
+static void analyze (lua_State *L, Analysis *an, TTree *tree, int size) {
+  int i;
+  size_t nfirsts = size / 2 + 1;  /* bound for sequences, choices, rules */
+  char *mem = (char *)lua_newuserdata(L, nfirsts * sizeof(FirstInfo) +
+                                   size * (sizeof(NodeInfo) + sizeof(int)));
+  an->root = tree;
+  an->firsts = (FirstInfo *)mem;
+  an->info = (NodeInfo *)(mem + nfirsts * sizeof(FirstInfo));
+  an->order = (int *)(an->info + size);
+  an->nfirsts = an->ntop = 0;
+  for (i = 0; i < size; i++) {
+    an->info[i].rule = RNone;
+    an->info[i].first = -1;
+  }
+  do {  /* repeat until approximations of recursive rules are stable */
+    for (i = 0; i < size; i++) {
+      NodeInfo *ni = &an->info[i];
+      ni->state = ANnew;
+      if (ni->rule == RNone)
+        ni->known = ni->value = 0;
+      else  /* keep approximation */
+        ni->rule = RBody;
+    }
+    an->grown = 0;
+    analyzetree(an, tree);
+  } while (an->grown);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Repeated subtrees
+** =======================================================
+*/
+
+/*
+** Identical subtrees with at least 'sharesize' slots are coded only
+** once, as a subroutine; each occurrence becomes a call to it (see
+** 'codegen'). Subtrees are classified bottom-up (hash-consing): two
+** nodes are in the same class when they have the same tag and
+** contents and their children are in the same classes; so, each
+** comparison takes constant time. Subtrees with rules or calls are
+** never shared, as calls to rules are corrected only inside the code
+** of their grammars; nor is 'true', which has no code (a call to it
+** could spoil a tail call).
+*/
+
+typedef struct Share {
+  TTree *root;  /* root of the tree being compiled */
+  TTree *body;  /* subtree being coded as a subroutine (or NULL) */
+  int *class;  /* class of each slot of the tree */
+  int *canon;  /* node of each class (its first occurrence) */
+  int *span;  /* size of each class (-1 if it cannot be shared) */
+  int *count;  /* occurrences of each class (coded as calls if > 1) */
+  int *code;  /* position of the subroutine of each class (or -1) */
+  unsigned int *hash;  /* hash of each class */
+  int *bucket;  /* hash table of classes (-1 for empty) */
+  int nbuckets;  /* size of 'bucket' (a power of 2) */
+  int nclasses;
+  int *sites;  /* pairs (call, class) of calls to subroutines */
+  int nsites;
+} Share;
+
+
+#define shareclass(sh,t)	((sh)->class[(t) - (sh)->root])
+
+#define hashmix(h,x)	(((h) ^ (unsigned int)(x)) * 16777619u)
+
+
+/*
+** Check whether nodes 'a' and 'b' (whose hashes are equal) are in the
+** same class
+*/
+static int sameclass (Share *sh, TTree *a, TTree *b) {
+  if (a->tag != b->tag) return 0;
+  switch (a->tag) {
+    case TSet:
+      return cs_equal(treebuffer(a), treebuffer(b));
+    case TChar: case TBehind:
+      if (a->u.n != b->u.n) return 0;
+      break;
+    case TCapture: case TRunTime:
+      if (a->cap != b->cap || a->key != b->key) return 0;
+      break;
+    default: break;
+  }
+  switch (numsiblings[a->tag]) {
+    case 2:
+      if (shareclass(sh, sib2(a)) != shareclass(sh, sib2(b))) return 0;
+      /* FALLTHROUGH */
+    case 1:
+      return (shareclass(sh, sib1(a)) == shareclass(sh, sib1(b)));
+    default: return 1;
+  }
+}
+
+
+/*
+** Find the class of node 't', whose children were already classified,
+** creating a new class if there is none
+*/
+static void classify (Share *sh, TTree *t) {
+  unsigned int h = t->tag;
+  int span = 1;
+  int i, c;
+  switch (t->tag) {
+    case TCall: case TOpenCall: case TRule: case TGrammar:
+      span = -1;  /* cannot be shared */
+      break;
+    case TSet:
+      span += bytes2slots(CHARSETSIZE);
+      loopset(j, h = hashmix(h, treebuffer(t)[j]));
+      break;
+    case TChar: case TBehind:
+      h = hashmix(h, t->u.n);
+      break;
+    case TCapture: case TRunTime:
+      h = hashmix(hashmix(h, t->cap), t->key);
+      break;
+    default: break;
+  }
+  if (span > 0) {
+    switch (numsiblings[t->tag]) {  /* add children */
+      case 2:
+        c = shareclass(sh, sib2(t));
+        h = hashmix(h, c);
+        span = (sh->span[c] < 0) ? -1 : span + sh->span[c];
+        /* FALLTHROUGH */
+      case 1:
+        c = shareclass(sh, sib1(t));
+        h = hashmix(h, c);
+        span = (sh->span[c] < 0 || span < 0) ? -1 : span + sh->span[c];
+        break;
+      default: break;
+    }
+  }
+  if (span > 0) {  /* look for its class */
+    for (i = h & (sh->nbuckets - 1); sh->bucket[i] >= 0;
+         i = (i + 1) & (sh->nbuckets - 1)) {
+      c = sh->bucket[i];
+      if (sh->hash[c] == h && sameclass(sh, sh->root + sh->canon[c], t)) {
+        shareclass(sh, t) = c;
+        sh->count[c]++;
+        return;
+      }
+    }
+    sh->bucket[i] = sh->nclasses;
+  }
+  c = sh->nclasses++;  /* new class */
+  sh->canon[c] = t - sh->root;
+  sh->span[c] = span;
+  sh->hash[c] = h;
+  sh->count[c] = 1;
+  sh->code[c] = -1;
+  shareclass(sh, t) = c;
+}
+
+
+/*
+** Find the subtrees of 'tree' (with 'size' slots) that will be coded as
+** subroutines: classes with at least 'sharesize' slots and with at
+** least two occurrences outside other shared subtrees (those are
+** coded only once). The memory for the result is a userdata left
+** on the stack.
+*/
+static void findshared (lua_State *L, Share *sh, TTree *tree, int size,
+                        int sharesize) {
+  int nbuckets = 1;
+  int *order;
+  int i, n;
+  while (nbuckets < 2 * size) nbuckets *= 2;
+  order = (int *)lua_newuserdata(L, (size * 9 + nbuckets) * sizeof(int));
+  sh->root = tree;
+  sh->body = NULL;
+  sh->class = order + size;
+  sh->canon = sh->class + size;
+  sh->span = sh->canon + size;
+  sh->count = sh->span + size;
+  sh->code = sh->count + size;
+  sh->hash = (unsigned int *)(sh->code + size);
+  sh->sites = (int *)(sh->hash + size);
+  sh->bucket = sh->sites + 2 * size;
+  sh->nbuckets = nbuckets;
+  sh->nclasses = sh->nsites = 0;
+  for (i = 0; i < nbuckets; i++) sh->bucket[i] = -1;
+  order[0] = 0;  /* collect all nodes, parents first */
+  for (i = 0, n = 1; i < n; i++) {
+    TTree *t = sh->root + order[i];
+    switch (numsiblings[t->tag]) {
+      case 2: order[n++] = sib2(t) - sh->root;  /* FALLTHROUGH */
+      case 1: order[n++] = sib1(t) - sh->root; break;
+      default: break;
+    }
+  }
+  while (n > 0)  /* classify them, children first */
+    classify(sh, sh->root + order[--n]);
+  for (i = 0; i < sh->nclasses; i++)  /* mark candidates with 0 */
+    sh->count[i] = (sh->span[i] >= sharesize && sh->count[i] > 1 &&
+                    sh->root[sh->canon[i]].tag != TTrue) - 1;
+  order[n++] = 0;  /* count occurrences, skipping repeated candidates */
+  while (n > 0) {
+    TTree *t = sh->root + order[--n];
+    int *count = &sh->count[shareclass(sh, t)];
+    if (*count >= 0 && (*count)++ > 0)
+      continue;  /* this occurrence will be a call */
+    switch (numsiblings[t->tag]) {
+      case 2: order[n++] = sib2(t) - sh->root;  /* FALLTHROUGH */
+      case 1: order[n++] = sib1(t) - sh->root; break;
+      default: break;
+    }
+  }
 }
 
 /* }====================================================== */
@@ -433,9 +1097,11 @@ int hasleftrecursion (TTree *tree) {
 int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
     case ISet: case ISpan: return CHARSETINSTSIZE;
+    case IString: return instsize(i->i.aux);
     case ITestSet: return CHARSETINSTSIZE + 1;
     case ITestChar: case ITestAny: case IChoice: case IJmp: case ICall:
     case IOpenCall: case ICommit: case IPartialCommit: case IBackCommit:
+    case IMemoCall:
       return 2;
     default: return 1;
   }
@@ -448,6 +1114,11 @@ int sizei (const Instruction *i) {
 typedef struct CompileState {
   Pattern *p;  /* pattern being compiled */
   int ncode;  /* next position in p->code to be filled */
+  Analysis *an;  /* properties of the nodes of the tree being compiled */
+  Share *share;  /* subtrees coded as subroutines (or NULL) */
+  int inlinesize;  /* maximum size of a rule inlined in its calls */
+  int failguards;  /* list of guards of calls (see 'codecall') */
+  int optlevel;  /* optimization level (see 'lpeg.setoptlevel') */
   lua_State *L;
 } CompileState;
 
@@ -490,6 +1161,7 @@ static int addinstruction (CompileState *compst, Opcode op, int aux) {
   int i = nextinstruction(compst);
   getinstr(compst, i).i.code = op;
   getinstr(compst, i).i.aux = aux;
+  getinstr(compst, i).i.key = 0;
   return i;
 }
 
@@ -549,6 +1221,60 @@ static void jumptohere (CompileState *compst, int instruction) {
 }
 
 
+/*
+** Check whether 'tree' has no calls (nor grammars)
+*/
+static int callfree (TTree *tree) {
+ tailcall:
+  switch (tree->tag) {
+    case TCall: case TOpenCall: case TGrammar:
+      return 0;
+    default: {
+      switch (numsiblings[tree->tag]) {
+        case 1:  /* return callfree(sib1(tree)); */
+          tree = sib1(tree); goto tailcall;
+        case 2:
+          if (!callfree(sib1(tree))) return 0;
+          /* else return callfree(sib2(tree)); */
+          tree = sib2(tree); goto tailcall;
+        default: return 1;
+      }
+    }
+  }
+}
+
+
+/*
+** If 'tree' is a call to be inlined, return the body of the called
+** rule; otherwise, return 'tree'. Calls to rules with no calls (so,
+** not recursive) and with at most 'inlinesize' slots are inlined,
+** unless they are left-recursive calls (or have a precedence) or
+** memoized calls.
+*/
+static TTree *inlined (CompileState *compst, TTree *tree) {
+  if (tree->tag == TCall && !tree->lr) {
+    TTree *rule = sib2(tree);
+    TTree *body = sib1(rule);
+    if (rule->u.ps - 1 <= compst->inlinesize && body->tag != TMemo &&
+        callfree(body))
+      return body;
+  }
+  return tree;
+}
+
+
+/*
+** Check whether 'tree' is an occurrence of a shared subtree (other
+** than the one being coded as a subroutine), to be coded as a call
+** (see 'codesharedcall')
+*/
+static int sharedcall (CompileState *compst, TTree *tree) {
+  Share *sh = compst->share;
+  return (sh != NULL && tree != sh->body &&
+          sh->count[shareclass(sh, tree)] > 1);
+}
+
+
 /*
 ** Code an IChar instruction, or IAny if there is an equivalent
 ** test dominating it
@@ -605,9 +1331,10 @@ static void codecharset (CompileState *compst, const byte *cs, int tt) {
 ** sets for ITestAny, and empty sets for IJmp (always fails).
 ** 'e' is true iff test should accept the empty string. (Test
 ** instructions in the current VM never accept the empty string.)
+** There are no tests at optimization level 0.
 */
 static int codetestset (CompileState *compst, Charset *cs, int e) {
-  if (e) return NOINST;  /* no test */
+  if (e || compst->optlevel == 0) return NOINST;  /* no test */
   else {
     int c = 0;
     Opcode op = charsettype(cs->cs, &c);
@@ -668,54 +1395,64 @@ static void codebehind (CompileState *compst, TTree *tree) {
 ** as then there is no character at all...)
 ** - when p2 is empty and opt is true; a IPartialCommit can reuse
 ** the Choice already active in the stack.
+** (At optimization level 0, only the last one is used, as it saves
+** stack space.)
+** A chain of choices nested to the right (as built by 'lpeg.choice')
+** is coded in a loop, not by recursion, so that its length does not
+** use C stack: all its alternatives end at the same place, so the
+** jumps to the end of each one are linked through their offsets
+** (as in 'codecall') and corrected when the chain is done.
 */
 static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
                         const Charset *fl) {
-  int emptyp2 = (p2->tag == TTrue);
-  if (hasleftrecursion(p1) || hasleftrecursion(p2))
-   {
-    int pcommit;
-    int pchoice = addoffsetinst(compst, IChoice, 0);
-    codegen(compst, p1, emptyp2, NOINST, fullset);
-    pcommit = addoffsetinst(compst, ICommit, 0);
-    jumptohere(compst, pchoice);
-    codegen(compst, p2, opt, NOINST, fl);
-    jumptohere(compst, pcommit);
-  }
-  else
-  {
-  Charset cs1, cs2;
-  int e1 = getfirst(p1, fullset, &cs1);
-  if (headfail(p1) ||
-      (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2)))) {
-    /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
-    int test = codetestset(compst, &cs1, 0);
-    int jmp = NOINST;
-    codegen(compst, p1, 0, test, fl);
-    if (!emptyp2)
-      jmp = addoffsetinst(compst, IJmp, 0);
-    jumptohere(compst, test);
-    codegen(compst, p2, opt, NOINST, fl);
-    jumptohere(compst, jmp);
-  }
-  else if (opt && emptyp2) {
-    /* p1? == IPartialCommit; p1 */
-    jumptohere(compst, addoffsetinst(compst, IPartialCommit, 0));
-    codegen(compst, p1, 1, NOINST, fullset);
-  }
-  else {
-    /* <p1 / p2> == 
-        test(first(p1)) -> L1; choice L1; <p1>; commit L2; L1: <p2>; L2: */
-    int pcommit;
-    int test = codetestset(compst, &cs1, e1);
-    int pchoice = addoffsetinst(compst, IChoice, 0);
-    codegen(compst, p1, emptyp2, test, fullset);
-    pcommit = addoffsetinst(compst, ICommit, 0);
-    jumptohere(compst, pchoice);
-    jumptohere(compst, test);
-    codegen(compst, p2, opt, NOINST, fl);
-    jumptohere(compst, pcommit);
+  int toend = NOINST;  /* list of jumps to the end of the chain */
+  for (;;) {
+    int emptyp2 = (inlined(compst, p2)->tag == TTrue);
+    Charset cs1, cs2;
+    int e1 = getfirst(compst->an, p1, fullset, &cs1);
+    if (compst->optlevel > 0 &&
+        (headfail(compst->an, p1) ||
+         (!e1 && (getfirst(compst->an, p2, fl, &cs2),
+                  cs_disjoint(&cs1, &cs2))))) {
+      /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
+      int test = codetestset(compst, &cs1, 0);
+      codegen(compst, p1, 0, test, fl);
+      if (!emptyp2) {
+        int jmp = addoffsetinst(compst, IJmp, 0);
+        setoffset(compst, jmp, toend);  /* link it */
+        toend = jmp;
+      }
+      jumptohere(compst, test);
+    }
+    else if (opt && emptyp2) {
+      /* p1? == IPartialCommit; p1 */
+      jumptohere(compst, addoffsetinst(compst, IPartialCommit, 0));
+      codegen(compst, p1, 1, NOINST, fullset);
+      break;
+    }
+    else {
+      /* <p1 / p2> == 
+          test(first(p1)) -> L1; choice L1; <p1>; commit L2; L1: <p2>; L2: */
+      int pcommit;
+      int test = codetestset(compst, &cs1, e1);
+      int pchoice = addoffsetinst(compst, IChoice, 0);
+      codegen(compst, p1, emptyp2, test, fullset);
+      pcommit = addoffsetinst(compst, ICommit, 0);
+      setoffset(compst, pcommit, toend);  /* link it */
+      toend = pcommit;
+      jumptohere(compst, pchoice);
+      jumptohere(compst, test);
+    }
+    if (p2->tag != TChoice || sharedcall(compst, p2)) {
+      codegen(compst, p2, opt, NOINST, fl);
+      break;
+    }
+    p1 = sib1(p2); p2 = sib2(p2);  /* code the rest of the chain */
   }
+  while (toend != NOINST) {  /* correct the jumps to the end */
+    int next = getinstr(compst, toend + 1).offset;
+    jumptohere(compst, toend);
+    toend = next;
   }
 }
 
@@ -726,8 +1463,9 @@ static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
 ** (valid only when 'p' has no captures)
 */
 static void codeand (CompileState *compst, TTree *tree, int tt) {
-  int n = fixedlen(tree);
-  if (n >= 0 && n <= MAXBEHIND && !hascaptures(tree)) {
+  int n = fixedlenx(compst->an, tree, 0, 0);
+  if (compst->optlevel > 0 && n >= 0 && n <= MAXBEHIND &&
+      !hascaptures(compst->an, tree)) {
     codegen(compst, tree, 0, tt, fullset);
     if (n > 0)
       addinstruction(compst, IBehind, n);
@@ -751,8 +1489,9 @@ static void codeand (CompileState *compst, TTree *tree, int tt) {
 */
 static void codecapture (CompileState *compst, TTree *tree, int tt,
                          const Charset *fl) {
-  int len = fixedlen(sib1(tree));
-  if (len >= 0 && len <= MAXOFF && !hascaptures(sib1(tree))) {
+  int len = fixedlenx(compst->an, sib1(tree), 0, 0);
+  if (compst->optlevel > 0 && len >= 0 && len <= MAXOFF &&
+      !hascaptures(compst->an, sib1(tree))) {
     codegen(compst, sib1(tree), 0, tt, fl);
     addinstcap(compst, IFullCapture, tree->cap, tree->key, len);
   }
@@ -780,32 +1519,21 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 ** again in the following pattern, so there is no need for a choice).
 ** When 'opt' is true, the repetion can reuse the Choice already
 ** active in the stack.
+** (At optimization level 0, only the last one is used, as it saves
+** stack space.)
 */
 static void coderep (CompileState *compst, TTree *tree, int opt,
                      const Charset *fl) {
   Charset st;
-  if (tocharset(tree, &st)) {
+  int optimize = (compst->optlevel > 0);
+  if (optimize && tocharset(inlined(compst, tree), &st)) {
     addinstruction(compst, ISpan, 0);
     addcharset(compst, st.cs);
   }
   else {
-    if (hasleftrecursion(tree)) {
-    int commit, l2;
-    int pchoice = NOINST;
-    if (opt)
-       jumptohere(compst, addoffsetinst(compst, IPartialCommit, 0));
-    else
-       pchoice = addoffsetinst(compst, IChoice, 0);
-    l2 = gethere(compst);
-    codegen(compst, tree, 0, NOINST, fullset);
-    commit = addoffsetinst(compst, IPartialCommit, 0);
-    jumptothere(compst, commit, l2);
-    jumptohere(compst, pchoice);
-  }
-  else
-  {
-    int e1 = getfirst(tree, fullset, &st);
-    if (headfail(tree) || (!e1 && cs_disjoint(&st, fl))) {
+    int e1 = getfirst(compst->an, tree, fullset, &st);
+    if (optimize &&
+        (headfail(compst->an, tree) || (!e1 && cs_disjoint(&st, fl)))) {
       /* L1: test (fail(p1)) -> L2; <p>; jmp L1; L2: */
       int jmp;
       int test = codetestset(compst, &st, 0);
@@ -831,7 +1559,6 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
       jumptohere(compst, pchoice);
       jumptohere(compst, test);
     }
-    }
   }
 }
 
@@ -844,19 +1571,11 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
 ** use the default code (a choice plus a failtwice).
 */
 static void codenot (CompileState *compst, TTree *tree) {
-
- if (hasleftrecursion(tree)) {
-  int pchoice = addoffsetinst(compst, IChoice, 0);
-  codegen(compst, tree, 0, NOINST, fullset);
-  addinstruction(compst, IFailTwice, 0);
-  jumptohere(compst, pchoice);
- }
- else
- {
   Charset st;
-  int e = getfirst(tree, fullset, &st);
+  int e = getfirst(compst->an, tree, fullset, &st);
   int test = codetestset(compst, &st, e);
-  if (headfail(tree))  /* test (fail(p1)) -> L1; fail; L1:  */
+  if (compst->optlevel > 0 && headfail(compst->an, tree))
+    /* test (fail(p1)) -> L1; fail; L1:  */
     addinstruction(compst, IFail, 0);
   else {
     /* test(fail(p))-> L1; choice L1; <p>; failtwice; L1:  */
@@ -866,16 +1585,17 @@ static void codenot (CompileState *compst, TTree *tree) {
     jumptohere(compst, pchoice);
   }
   jumptohere(compst, test);
- }
 }
 
 
 /*
 ** change open calls to calls, using list 'positions' to find
-** correct offsets; also optimize tail calls
+** correct offsets; also optimize tail calls. Calls keep in 'key' the
+** name of the called rule (from list 'names'), for profiling. Calls
+** followed by 'IMemoEnd' (see 'codecall') become memoized calls.
 */
 static void correctcalls (CompileState *compst, int *positions,
-                          int from, int to) {
+                          const unsigned short *names, int from, int to) {
   int i;
   Instruction *code = compst->p->code;
   for (i = from; i < to; i += sizei(&code[i])) {
@@ -883,10 +1603,13 @@ static void correctcalls (CompileState *compst, int *positions,
       int n = code[i].i.key;  /* rule number */
       int rule = positions[n];  /* rule position */
       assert(rule == from || code[rule - 1].i.code == IRet);
-      if (code[i].i.aux == 0 && code[finaltarget(code, i + 2)].i.code == IRet)  /* call; ret ? */
+      if (code[i + 2].i.code == IMemoEnd)  /* memoized call? */
+        code[i].i.code = IMemoCall;
+      else if (code[i].i.aux == 0 && code[finaltarget(code, i + 2)].i.code == IRet)  /* call; ret ? */
         code[i].i.code = IJmp;  /* tail call */
       else
         code[i].i.code = ICall;
+      code[i].i.key = names[n];
       jumptothere(compst, i, rule);  /* call jumps to respective rule */
     }
   }
@@ -900,27 +1623,58 @@ static void correctcalls (CompileState *compst, int *positions,
 */
 static void codegrammar (CompileState *compst, TTree *grammar) {
   int positions[MAXRULES];
+  unsigned short names[MAXRULES];
   int rulenumber = 0;
   TTree *rule;
   int firstcall = addoffsetinst(compst, ICall, sib1(grammar)->lr);  /* call initial rule */
   int jumptoend = addoffsetinst(compst, IJmp, 0);  /* jump to the end */
   int start = gethere(compst);  /* here starts the initial rule */
   jumptohere(compst, firstcall);
+  getinstr(compst, firstcall).i.key = sib1(grammar)->key;
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
+    names[rulenumber] = rule->key;  /* save rule name (0 if not known) */
     positions[rulenumber++] = gethere(compst);  /* save rule position */
     codegen(compst, sib1(rule), 0, NOINST, fullset);  /* code rule */
     addinstruction(compst, IRet, 0);
   }
   assert(rule->tag == TTrue);
   jumptohere(compst, jumptoend);
-  correctcalls(compst, positions, start, gethere(compst));
+  correctcalls(compst, positions, names, start, gethere(compst));
 }
 
 
-static void codecall (CompileState *compst, TTree *call) {
-  int c = addoffsetinst(compst, IOpenCall, call->lr);  /* to be corrected later */
+/*
+** Code for a call. A (non left-recursive) call to a rule whose
+** pattern is a TMemo is a memoized call:
+** memocall rule; memoend; memofail
+** where 'memofail' is where the call goes when the rule fails.
+** A (non left-recursive) call to a rule that cannot match the empty
+** string is guarded (at optimization level 2) by a test of the first
+** set of the rule, unless a previous test 'tt' already protects it:
+** test first(rule) -> Lfail; call rule
+** so that a call doomed to fail does not push a frame. 'Lfail' is a
+** common 'fail' after the code (see 'codefailguards'); until then,
+** the guards are linked through their offsets.
+*/
+static void codecall (CompileState *compst, TTree *call, int tt) {
+  int c;
+  if (compst->optlevel >= 2 && !call->lr && tt == NOINST) {
+    Charset cs;
+    int e = getfirst(compst->an, call, fullset, &cs);
+    Opcode op = charsettype(cs.cs, &c);
+    if (e == 0 && (op == IChar || op == ISet)) {  /* useful test? */
+      int test = codetestset(compst, &cs, 0);
+      setoffset(compst, test, compst->failguards);  /* link it */
+      compst->failguards = test;
+    }
+  }
+  c = addoffsetinst(compst, IOpenCall, call->lr);  /* to be corrected later */
   getinstr(compst, c).i.key = sib2(call)->cap;  /* rule number */
   assert(sib2(call)->tag == TRule);
+  if (!call->lr && sib1(sib2(call))->tag == TMemo) {
+    addinstruction(compst, IMemoEnd, 0);
+    addinstruction(compst, IMemoFail, 0);
+  }
 }
 
 
@@ -933,25 +1687,42 @@ static int codeseq1 (CompileState *compst, TTree *p1, TTree *p2,
                      int tt, const Charset *fl) {
   if (needfollow(p1)) {
     Charset fl1;
-    getfirst(p2, fl, &fl1);  /* p1 follow is p2 first */
+    getfirst(compst->an, p2, fl, &fl1);  /* p1 follow is p2 first */
     codegen(compst, p1, 0, tt, &fl1);
   }
   else  /* use 'fullset' as follow */
     codegen(compst, p1, 0, tt, fullset);
-  if (fixedlen(p1) != 0)  /* can 'p1' consume anything? */
+  if (fixedlenx(compst->an, p1, 0, 0) != 0)  /* can 'p1' consume anything? */
     return  NOINST;  /* invalidate test */
   else return tt;  /* else 'tt' still protects sib2 */
 }
 
 
+/*
+** Code an occurrence of a shared subtree of class 'c': a call to its
+** subroutine, to be corrected by 'codeshared'
+*/
+static void codesharedcall (CompileState *compst, int c) {
+  Share *sh = compst->share;
+  int call = addoffsetinst(compst, ICall, 0);
+  sh->sites[sh->nsites++] = call;
+  sh->sites[sh->nsites++] = c;
+}
+
+
 /*
 ** Main code-generation function: dispatch to auxiliar functions
 ** according to kind of tree. ('needfollow' should return true
-** only for consructions that use 'fl'.)
+** only for consructions that use 'fl'.) Shared subtrees (other than
+** the one being coded as a subroutine) become calls.
 */
 static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
                      const Charset *fl) {
  tailcall:
+  if (sharedcall(compst, tree)) {
+    codesharedcall(compst, shareclass(compst->share, tree));
+    return;
+  }
   switch (tree->tag) {
     case TChar: codechar(compst, tree->u.n, tt); break;
     case TAny: addinstruction(compst, IAny, 0); break;
@@ -966,7 +1737,17 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TCapture: codecapture(compst, tree, tt, fl); break;
     case TRunTime: coderuntime(compst, tree, tt); break;
     case TGrammar: codegrammar(compst, tree); break;
-    case TCall: codecall(compst, tree); break;
+    case TCall: {
+      TTree *body = inlined(compst, tree);
+      if (body == tree)
+        codecall(compst, tree, tt);
+      else {  /* codegen(compst, body, opt, tt, fl); */
+        tree = body; goto tailcall;
+      }
+      break;
+    }
+    case TMemo:  /* memoization is done by the calls to the rule */
+      tree = sib1(tree); goto tailcall;
     case TSeq: {
       tt = codeseq1(compst, sib1(tree), sib2(tree), tt, fl);  /* code 'p1' */
       /* codegen(compst, p2, opt, tt, fl); */
@@ -978,13 +1759,252 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
 
 
 /*
-** Optimize jumps and other jump-like instructions.
+** Code the subroutines of the shared subtrees, after the code of the
+** pattern ('nsites' grows while they are coded, as they may call
+** other subroutines), and correct the calls to them, optimizing
+** tail calls:
+** L1: <subtree 1>; ret; L2: <subtree 2>; ret; ...
+*/
+static void codeshared (CompileState *compst) {
+  Share *sh = compst->share;
+  Instruction *code;
+  int i;
+  for (i = 0; i < sh->nsites; i += 2) {
+    int c = sh->sites[i + 1];
+    if (sh->code[c] < 0) {  /* not coded yet? */
+      sh->code[c] = gethere(compst);
+      sh->body = sh->root + sh->canon[c];
+      codegen(compst, sh->body, 0, NOINST, fullset);
+      addinstruction(compst, IRet, 0);
+    }
+  }
+  sh->body = NULL;
+  code = compst->p->code;
+  for (i = 0; i < sh->nsites; i += 2) {
+    int call = sh->sites[i];
+    if (code[finaltarget(code, call + 2)].i.code == IRet)  /* call; ret ? */
+      code[call].i.code = IJmp;  /* tail call */
+    jumptothere(compst, call, sh->code[sh->sites[i + 1]]);
+  }
+}
+
+
+/*
+** Code the common 'fail' where the guards of calls (see 'codecall')
+** jump to
+*/
+static void codefailguards (CompileState *compst) {
+  if (compst->failguards != NOINST) {
+    int fail = addinstruction(compst, IFail, 0);
+    int i = compst->failguards;
+    while (i != NOINST) {
+      int next = getinstr(compst, i + 1).offset;
+      jumptothere(compst, i, fail);
+      i = next;
+    }
+  }
+}
+
+
+/* flags for instructions, used by 'compactcode' */
+#define Lreached	1  /* instruction is reachable */
+#define Ltarget		2  /* instruction is the target of a label */
+
+
+static int haslabel (Opcode op) {
+  switch (op) {
+    case IChoice: case IJmp: case ICall: case ICommit: case IPartialCommit:
+    case IBackCommit: case ITestChar: case ITestSet: case ITestAny:
+    case IMemoCall:
+      return 1;
+    default: return 0;
+  }
+}
+
+
+/*
+** Check whether control can go from an instruction to the next one
+*/
+static int fallsthrough (Opcode op) {
+  switch (op) {
+    case IJmp: case ICommit: case IPartialCommit: case IBackCommit:
+    case IRet: case IEnd: case IFail: case IFailTwice: case IGiveup:
+    case IMemoFail:
+      return 0;
+    default: return 1;
+  }
+}
+
+
+/*
+** Mark the instructions reachable from the first one, and the targets
+** of their labels. Besides its label and the next instruction, a
+** memoized call goes to its 'IMemoFail' (when the rule fails), and
+** 'IMemoEnd' skips that 'IMemoFail'. ('stack' has room for three
+** entries per instruction.)
+*/
+static void markreached (Instruction *code, int *flags, int *stack) {
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    int i = stack[--top];
+    Opcode op = (Opcode)code[i].i.code;
+    if (flags[i] & Lreached) continue;
+    flags[i] |= Lreached;
+    if (haslabel(op)) {
+      flags[target(code, i)] |= Ltarget;
+      stack[top++] = target(code, i);
+    }
+    if (op == IMemoCall)
+      stack[top++] = i + 3;  /* its 'IMemoFail' */
+    if (op == IMemoEnd)
+      stack[top++] = i + 2;  /* skip 'IMemoFail' */
+    else if (fallsthrough(op))
+      stack[top++] = i + sizei(&code[i]);
+  }
+}
+
+
+/*
+** Add to 'str' (with '*len' chars) the chars of the run of 'char'
+** instructions starting at 'i', stopping at targets of labels; return
+** the index after the run
+*/
+static int charrun (Instruction *code, int *flags, int i, byte *str,
+                    int *len) {
+  while (*len < UCHAR_MAX && code[i].i.code == IChar &&
+         !(flags[i] & Ltarget))
+    str[(*len)++] = code[i++].i.aux;
+  return i;
+}
+
+
+/*
+** Add to 'out' (at 'n') a 'string' instruction for 'str', with 'len'
+** chars; return the index after it
+*/
+static int addstring (Instruction *out, int n, const byte *str, int len) {
+  out[n].i.code = IString;
+  out[n].i.aux = len;
+  out[n].i.key = 0;
+  memcpy(out[n + 1].buff, str, len);
+  return n + instsize(len);
+}
+
+
+/*
+** Remove unreachable instructions and compact the code, relocating
+** the labels and shrinking the code array. On the way, fuse some
+** sequences (no instruction absorbed by a fusion can be the target
+** of a label):
+** * a jump to the next instruction kept disappears;
+** * a test whose label goes to a 'fail', followed by an 'any',
+** becomes a single 'char', 'set', or 'any';
+** * a sequence of 'char's (or a 'testchar' followed by an 'any' and
+** 'char's) becomes a 'string' (after the 'testchar').
+** While the code is compacted, labels keep their old targets, as
+** absolute addresses; 'newpc' maps them to the new ones at the end.
+*/
+static void compactcode (CompileState *compst) {
+  lua_State *L = compst->L;
+  Instruction *code = compst->p->code;
+  int ncode = compst->ncode;
+  Instruction *out = (Instruction *)lua_newuserdata(L,
+         ncode * sizeof(Instruction) + (5 * ncode + 1) * sizeof(int));
+  int *flags = (int *)(out + ncode);
+  int *newpc = flags + ncode;
+  int n = 0;  /* size of new code */
+  int i;
+  byte str[UCHAR_MAX];
+  int len;
+  for (i = 0; i < ncode; i++) flags[i] = 0;
+  markreached(code, flags, newpc + ncode + 1);
+  for (i = 0; i < ncode; i += sizei(&code[i])) {
+    int next = i + sizei(&code[i]);
+    newpc[i] = n;
+    if (!(flags[i] & Lreached))
+      continue;
+    switch ((Opcode)code[i].i.code) {
+      case IJmp: {
+        int j;  /* skip unreachable code after the jump */
+        for (j = next; j < target(code, i) && !(flags[j] & Lreached);
+             j += sizei(&code[j])) ;
+        if (j == target(code, i))  /* jump to next instruction kept? */
+          continue;  /* remove it */
+        break;
+      }
+      case ITestChar: case ITestSet: case ITestAny: {
+        if (code[target(code, i)].i.code == IFail &&
+            code[next].i.code == IAny && !(flags[next] & Ltarget)) {
+          Opcode op = (code[i].i.code == ITestChar) ? IChar :
+                      (code[i].i.code == ITestSet) ? ISet : IAny;
+          out[n] = code[i];
+          out[n].i.code = op;
+          if (op == ISet)  /* copy the set */
+            memcpy(out + n + 1, code + i + 2,
+                   (CHARSETINSTSIZE - 1) * sizeof(Instruction));
+          n += sizei(&out[n]);
+          newpc[next] = n;
+          i = next;  /* skip the 'any' */
+          continue;
+        }
+        if (code[i].i.code == ITestChar && code[next].i.code == IAny &&
+            !(flags[next] & Ltarget)) {
+          str[0] = code[i].i.aux;  /* the 'any' matches that char */
+          len = 1;
+          if (charrun(code, flags, next + 1, str, &len) - next > 1) {
+            out[n] = code[i];
+            out[n + 1].offset = target(code, i);
+            newpc[next] = n += 2;
+            n = addstring(out, n, str, len);
+            i = next + len - 1;  /* (last 'char' in the run) */
+            continue;
+          }
+        }
+        break;
+      }
+      case IChar: {
+        len = 0;
+        str[len++] = code[i].i.aux;
+        if (charrun(code, flags, next, str, &len) - next > 0) {
+          n = addstring(out, n, str, len);
+          i += len - 1;  /* (last 'char' in the run) */
+          continue;
+        }
+        break;
+      }
+      default: break;
+    }
+    memcpy(out + n, code + i, (next - i) * sizeof(Instruction));
+    if (haslabel((Opcode)code[i].i.code))
+      out[n + 1].offset = target(code, i);  /* keep old target */
+    n = n + (next - i);
+  }
+  for (i = 0; i < n; i += sizei(&out[i])) {  /* relocate labels */
+    assert(i + sizei(&out[i]) < n || !fallsthrough((Opcode)out[i].i.code));
+    if (haslabel((Opcode)out[i].i.code))
+      out[i + 1].offset = newpc[out[i + 1].offset] - i;
+  }
+  realloccode(L, compst->p, n);
+  memcpy(compst->p->code, out, n * sizeof(Instruction));
+  compst->ncode = n;
+  lua_pop(L, 1);  /* remove work memory */
+}
+
+
+/*
+** Optimize jumps and other jump-like instructions, and then (at
+** optimization level 2) do the fusions below and remove dead code
+** (see 'compactcode').
 ** * Update labels of instructions with labels to their final
 ** destinations (e.g., choice L1; ... L1: jmp L2: becomes
 ** choice L2)
 ** * Jumps to other instructions that do jumps become those
 ** instructions (e.g., jump to return becomes a return; jump
 ** to commit becomes a commit)
+** * A commit (or a back commit) to a fail becomes a failtwice
+** * A choice followed by its commit (an alternative that cannot
+** fail) becomes a jump to the commit's target
 */
 static void peephole (CompileState *compst) {
   Instruction *code = compst->p->code;
@@ -992,9 +2012,26 @@ static void peephole (CompileState *compst) {
   for (i = 0; i < compst->ncode; i += sizei(&code[i])) {
    redo:
     switch (code[i].i.code) {
-      case IChoice: case ICall: case ICommit: case IPartialCommit:
-      case IBackCommit: case ITestChar: case ITestSet:
-      case ITestAny: {  /* instructions with labels */
+      case IChoice: {
+        if (compst->optlevel >= 2 &&
+            code[i + 2].i.code == ICommit) {  /* choice L1; commit L2? */
+          code[i].i.code = IJmp;
+          jumptothere(compst, i, target(code, i + 2));
+          goto redo;
+        }
+        jumptothere(compst, i, finallabel(code, i));  /* optimize label */
+        break;
+      }
+      case ICommit: case IBackCommit: {
+        jumptothere(compst, i, finallabel(code, i));  /* optimize label */
+        if (compst->optlevel >= 2 && code[target(code, i)].i.code == IFail) {
+          code[i].i.code = IFailTwice;
+          code[i + 1].i.code = IAny;  /* 'no-op' for target position */
+        }
+        break;
+      }
+      case ICall: case IPartialCommit: case ITestChar: case ITestSet:
+      case ITestAny: case IMemoCall: {  /* instructions with labels */
         jumptothere(compst, i, finallabel(code, i));  /* optimize label */
         break;
       }
@@ -1024,21 +2061,58 @@ static void peephole (CompileState *compst) {
       default: break;
     }
   }
-  assert(code[i - 1].i.code == IEnd);
+  if (compst->optlevel >= 2)
+    compactcode(compst);
 }
 
 
 /*
-** Compile a pattern
+** Compile tree 'tree' (the tree of pattern 'p', or a copy of it),
+** with 'size' slots, into the code of 'p', with optimization
+** level 'level': level 0 is a literal translation of the tree (but
+** for tail calls and the reuse of choices by optional patterns, which
+** save stack space, so that all levels need the same stack); level
+** 1 adds the optimizations based on first sets (tests, spans, etc.)
+** and jump optimization; level 2 adds the passes that reshape the
+** code (sharing, inlining, guards of calls, and the fusions and dead
+** code removal of 'peephole'). When 'ph' is not NULL, add the time
+** spent in each phase to it.
 */
-Instruction *compile (lua_State *L, Pattern *p) {
+Instruction *compile (lua_State *L, Pattern *p, TTree *tree, int size,
+                      int level, Phases *ph) {
   CompileState compst;
-  compst.p = p;  compst.ncode = 0;  compst.L = L;
+  Analysis an;
+  Share sh;
+  int sharesize;
+  clock_t t = (ph != NULL) ? clock() : 0;
+  compst.p = p;  compst.ncode = 0;  compst.L = L;  compst.an = &an;
+  compst.share = NULL;  compst.failguards = NOINST;
+  compst.optlevel = level;
+  lua_getfield(L, LUA_REGISTRYINDEX, SHARESIZEIDX);
+  sharesize = (int)lua_tointeger(L, -1);
+  lua_getfield(L, LUA_REGISTRYINDEX, INLINESIZEIDX);
+  compst.inlinesize = (int)lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  if (level < 2)  /* no sharing nor inlining? */
+    sharesize = compst.inlinesize = 0;
+  analyze(L, &an, tree, size);
+  if (sharesize > 0) {
+    findshared(L, &sh, tree, size, sharesize);
+    compst.share = &sh;
+  }
+  phasetime(ph, analysis, t);
   realloccode(L, p, 2);  /* minimum initial size */
-  codegen(&compst, p->tree, 0, NOINST, fullset);
+  codegen(&compst, tree, 0, NOINST, fullset);
   addinstruction(&compst, IEnd, 0);
+  if (compst.share != NULL)
+    codeshared(&compst);
+  codefailguards(&compst);
   realloccode(L, p, compst.ncode);  /* set final size */
-  peephole(&compst);
+  phasetime(ph, codegen, t);
+  if (level > 0)
+    peephole(&compst);
+  phasetime(ph, peephole, t);
+  lua_pop(L, (compst.share != NULL) ? 2 : 1);  /* remove analysis memory */
   return p->code;
 }
 
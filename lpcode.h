@@ -5,39 +5,64 @@
 #if !defined(lpcode_h)
 #define lpcode_h
 
+#include <time.h>
+
 #include "lua.h"
 
 #include "lptypes.h"
 #include "lptree.h"
 #include "lpvm.h"
 
+/*
+** Cached properties of the nodes of a tree being compiled (see
+** lpcode.c); the analyses accept NULL for no cache
+*/
+typedef struct Analysis Analysis;
+
 int tocharset (TTree *tree, Charset *cs);
-int checkaux (TTree *tree, int pred);
-int fixedlenx (TTree *tree, int count, int len);
-int hascaptures (TTree *tree);
-int hasleftrecursion (TTree *tree);
+int checkaux (const Analysis *an, TTree *tree, int pred);
+int fixedlenx (const Analysis *an, TTree *tree, int count, int len);
+int hascaptures (const Analysis *an, TTree *tree);
+
+/*
+** Processor time spent in each phase of the construction of a pattern
+** (see 'lpeg.compilestats')
+*/
+typedef struct Phases {
+  clock_t grammar;  /* collecting and building the rules of a grammar */
+  clock_t finalfix;  /* fixing open calls and keys */
+  clock_t verify;  /* checking a grammar for infinite loops */
+  clock_t analysis;  /* computing the properties of the nodes */
+  clock_t codegen;  /* generating code */
+  clock_t peephole;  /* optimizing jumps */
+} Phases;
+
+/* add the time since 't' to 'ph->f' (if 'ph' is not NULL); reset 't' */
+#define phasetime(ph,f,t)  \
+  { if ((ph) != NULL) { clock_t t_ = clock(); (ph)->f += t_ - (t); (t) = t_; } }
+
 int lp_gc (lua_State *L);
-Instruction *compile (lua_State *L, Pattern *p);
+Instruction *compile (lua_State *L, Pattern *p, TTree *tree, int size,
+                      int level, Phases *ph);
 void realloccode (lua_State *L, Pattern *p, int nsize);
 int sizei (const Instruction *i);
 
 
 #define PEnullable      0
 #define PEnofail        1
-#define PEleftrecursion 2
 
 /*
 ** nofail(t) implies that 't' cannot fail with any input
 */
-#define nofail(t)	checkaux(t, PEnofail)
+#define nofail(t)	checkaux(NULL, t, PEnofail)
 
 /*
 ** (not nullable(t)) implies 't' cannot match without consuming
 ** something
 */
-#define nullable(t)	checkaux(t, PEnullable)
+#define nullable(t)	checkaux(NULL, t, PEnullable)
 
-#define fixedlen(t)     fixedlenx(t, 0, 0)
+#define fixedlen(t)     fixedlenx(NULL, t, 0, 0)
 
 
 
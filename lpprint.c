@@ -54,13 +54,14 @@ static void printjmp (const Instruction *op, const Instruction *p) {
 
 void printinst (const Instruction *op, const Instruction *p) {
   const char *const names[] = {
-    "any", "char", "set",
+    "any", "char", "set", "string",
     "testany", "testchar", "testset",
     "span", "behind",
     "ret", "end",
     "choice", "jmp", "call", "open_call",
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
-     "fullcapture", "opencapture", "closecapture", "closeruntime"
+     "fullcapture", "opencapture", "closecapture", "closeruntime",
+     "memocall", "memoend", "memofail"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
   switch ((Opcode)p->i.code) {
@@ -68,6 +69,10 @@ void printinst (const Instruction *op, const Instruction *p) {
       printf("'%c'", p->i.aux);
       break;
     }
+    case IString: {
+      printf("'%.*s'", p->i.aux, (const char *)(p + 1)->buff);
+      break;
+    }
     case ITestChar: {
       printf("'%c'", p->i.aux); printjmp(op, p);
       break;
@@ -103,7 +108,7 @@ void printinst (const Instruction *op, const Instruction *p) {
       break;
     }
     case IJmp: case ICall: case ICommit: case IChoice:
-    case IPartialCommit: case IBackCommit: case ITestAny: {
+    case IPartialCommit: case IBackCommit: case ITestAny: case IMemoCall: {
       printjmp(op, p);
       break;
     }
@@ -125,13 +130,13 @@ void printpatt (Instruction *p, int n) {
 #if defined(LPEG_DEBUG)
 static void printcap (Capture *cap) {
   printcapkind(cap->kind);
-  printf(" (idx: %d - size: %d) -> %p\n", cap->idx, cap->siz, cap->s);
+  printf(" (idx: %d - size: %u) -> %u\n", cap->idx, cap->siz, cap->index);
 }
 
 
 void printcaplist (Capture *cap, Capture *limit) {
   printf(">======\n");
-  for (; cap->s && (limit == NULL || cap < limit); cap++)
+  for (; cap->index != MAXINDT && (limit == NULL || cap < limit); cap++)
     printcap(cap);
   printf("=======\n");
 }
@@ -154,7 +159,8 @@ static const char *tagnames[] = {
   "not", "and",
   "call", "opencall", "rule", "grammar",
   "behind",
-  "capture", "run-time"
+  "capture", "run-time",
+  "memo"
 };
 
 
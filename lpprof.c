@@ -0,0 +1,428 @@
+/*
+** Profiling of pattern matching
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lpcode.h"
+#include "lpprof.h"
+
+
+/*
+** {======================================================
+** Profile counters
+** =======================================================
+*/
+
+/*
+** Create a new profile for a code with 'ncode' instructions matching
+** a subject with length 'len', with all counters zeroed. The profile
+** (and its arrays) live in a userdata pushed on the stack.
+*/
+Profile *newprofile (lua_State *L, int ncode, size_t len) {
+  size_t n = (size_t)ncode + 1;  /* (avoid empty arrays) */
+  size_t npos = len + 1;  /* a match may restart at the end, too */
+  int nbuckets = (npos < MAXBUCKETS) ? (int)npos : MAXBUCKETS;
+  size_t total = 4 * n + nbuckets;
+  Profile *prof = (Profile *)lua_newuserdata(L, sizeof(Profile) +
+                                                total * sizeof(unsigned long));
+  unsigned long *counters = (unsigned long *)(prof + 1);
+  memset(counters, 0, total * sizeof(unsigned long));
+  prof->ncode = ncode;
+  prof->rule = 0;
+  prof->count = counters;
+  prof->backtrack = counters + n;
+  prof->insts = counters + 2 * n;
+  prof->bytes = counters + 3 * n;
+  prof->restarts = counters + 4 * n;
+  prof->npos = npos;
+  prof->bucketsize = (npos + nbuckets - 1) / nbuckets;
+  prof->nbuckets = (int)((npos + prof->bucketsize - 1) / prof->bucketsize);
+  prof->maxdepth = 1;  /* (the bottom entry of the stack) */
+  prof->lrentries = prof->lrgrowths = prof->lrcapbytes = 0;
+  return prof;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Report
+** =======================================================
+*/
+
+static const char *const opnames[] = {
+  "any", "char", "set", "string",
+  "testany", "testchar", "testset",
+  "span", "behind",
+  "ret", "end",
+  "choice", "jmp", "call", "open_call",
+  "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
+  "fullcapture", "opencapture", "closecapture", "closeruntime",
+  "memocall", "memoend", "memofail"
+};
+
+
+#define target(op,p)	((int)((p) + ((p) + 1)->offset - (op)))
+
+
+/*
+** Push the name of the rule called by instruction 'p' (a call or a
+** tail call), or its address when the name is not known
+*/
+static void pushrulename (lua_State *L, const Instruction *op,
+                          const Instruction *p, int ktable) {
+  if (p->i.key == 0 || (lua_rawgeti(L, ktable, p->i.key), lua_isnil(L, -1))) {
+    if (p->i.key != 0) lua_pop(L, 1);  /* remove nil */
+    lua_pushfstring(L, "rule@%d", target(op, p));
+  }
+}
+
+
+/*
+** Whether instruction 'p' enters a rule: a call, a memoized call, or
+** a tail call (a jump that keeps the name of the called rule; see
+** 'correctcalls')
+*/
+static int isruleentry (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case ICall: case IMemoCall: return 1;
+    case IJmp: return (p->i.key != 0);
+    default: return 0;
+  }
+}
+
+
+/*
+** Build a table 'names' mapping the address of each rule entered by
+** the code to its name, and return its stack index
+*/
+static int rulenames (lua_State *L, const Instruction *op, int ncode,
+                      int ktable) {
+  const Instruction *p;
+  int names;
+  lua_newtable(L);
+  names = lua_gettop(L);
+  for (p = op; p < op + ncode; p += sizei(p)) {
+    if (isruleentry(p)) {
+      lua_rawgeti(L, names, target(op, p));
+      if (lua_isnil(L, -1)) {  /* first entry to that rule? */
+        pushrulename(L, op, p, ktable);
+        lua_rawseti(L, names, target(op, p));
+      }
+      lua_pop(L, 1);
+    }
+  }
+  return names;
+}
+
+
+/*
+** Count in 'calls' (indexed by address) the times each rule in 'names'
+** was entered, by a call or by a jump (a tail call, maybe moved by the
+** peephole optimizer to a jump that went to it)
+*/
+static void countcalls (lua_State *L, const Instruction *op, int names,
+                        Profile *prof, unsigned long *calls) {
+  const Instruction *p;
+  memset(calls, 0, prof->ncode * sizeof(unsigned long));
+  for (p = op; p < op + prof->ncode; p += sizei(p)) {
+    Opcode code = (Opcode)p->i.code;
+    if (code == ICall || code == IMemoCall || code == IJmp) {
+      int t = target(op, p);
+      if (code == IJmp) {  /* only jumps to rules count */
+        int isrule;
+        lua_rawgeti(L, names, t);
+        isrule = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!isrule) continue;
+      }
+      calls[t] += prof->count[p - op];
+    }
+  }
+}
+
+
+static void addcharset (luaL_Buffer *b, const byte *st) {
+  char buff[16];
+  int i;
+  luaL_addchar(b, '[');
+  for (i = 0; i <= UCHAR_MAX; i++) {
+    int first = i;
+    while (i <= UCHAR_MAX && testchar(st, i)) i++;
+    if (i - 1 == first)  /* unary range? */
+      sprintf(buff, "(%02x)", first);
+    else if (i - 1 > first)  /* non-empty range? */
+      sprintf(buff, "(%02x-%02x)", first, i - 1);
+    else continue;
+    luaL_addstring(b, buff);
+  }
+  luaL_addchar(b, ']');
+}
+
+
+/*
+** Add to buffer 'b' one line of the listing, with the counters for
+** instruction 'p': times executed, times its choice was backtracked to
+** (for choices), address, opcode, and operands.
+*/
+static void addinstline (lua_State *L, luaL_Buffer *b, const Instruction *op,
+                         const Instruction *p, int names, Profile *prof) {
+  char buff[100];
+  int pc = (int)(p - op);
+  if (p->i.code == IChoice)
+    sprintf(buff, "%10lu %8lu  %04d  %s ", prof->count[pc],
+                  prof->backtrack[pc], pc, opnames[p->i.code]);
+  else
+    sprintf(buff, "%10lu %8s  %04d  %s ", prof->count[pc], "",
+                  pc, opnames[p->i.code]);
+  luaL_addstring(b, buff);
+  switch ((Opcode)p->i.code) {
+    case IChar: case ITestChar: {
+      sprintf(buff, "(%02x) ", p->i.aux);
+      luaL_addstring(b, buff);
+      break;
+    }
+    case ISet: case ISpan: {
+      addcharset(b, (p + 1)->buff);
+      break;
+    }
+    case IString: {
+      int i;
+      for (i = 0; i < p->i.aux; i++) {
+        sprintf(buff, (i == 0) ? "(%02x" : " %02x", (p + 1)->buff[i]);
+        luaL_addstring(b, buff);
+      }
+      luaL_addstring(b, ") ");
+      break;
+    }
+    case ITestSet: {
+      addcharset(b, (p + 2)->buff);
+      luaL_addchar(b, ' ');
+      break;
+    }
+    case IBehind: {
+      sprintf(buff, "%d", p->i.aux);
+      luaL_addstring(b, buff);
+      break;
+    }
+    default: break;
+  }
+  if (isruleentry(p)) {  /* call or tail call? */
+    sprintf(buff, "-> %04d ", target(op, p));
+    luaL_addstring(b, buff);
+    lua_rawgeti(L, names, target(op, p));
+    luaL_addvalue(b);
+  }
+  else {
+    switch ((Opcode)p->i.code) {
+      case ITestChar: case ITestSet: case ITestAny: case IChoice: case IJmp:
+      case ICommit: case IPartialCommit: case IBackCommit: {
+        sprintf(buff, "-> %04d", target(op, p));
+        luaL_addstring(b, buff);
+        break;
+      }
+      default: break;
+    }
+  }
+  luaL_addchar(b, '\n');
+}
+
+
+/*
+** Push a string with the annotated listing of the code
+*/
+static void pushlisting (lua_State *L, const Instruction *op, int names,
+                         Profile *prof) {
+  luaL_Buffer b;
+  const Instruction *p;
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "     count  backtr  addr  instruction\n");
+  for (p = op; p < op + prof->ncode; p += sizei(p)) {
+    lua_rawgeti(L, names, (int)(p - op));
+    if (!lua_isnil(L, -1)) {  /* start of a rule? */
+      lua_pushfstring(L, "%s:\n", lua_tostring(L, -1));
+      lua_remove(L, -2);
+      luaL_addvalue(&b);
+    }
+    else
+      lua_pop(L, 1);
+    addinstline(L, &b, op, p, names, prof);
+  }
+  luaL_pushresult(&b);
+}
+
+
+/*
+** Set field 'name' of table at the top to the non-zero entries of
+** 'counters', indexed by instruction address
+*/
+static void setcounters (lua_State *L, const char *name,
+                         const unsigned long *counters, int ncode) {
+  int i;
+  lua_newtable(L);
+  for (i = 0; i < ncode; i++) {
+    if (counters[i] != 0) {
+      lua_pushnumber(L, (lua_Number)counters[i]);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  lua_setfield(L, -2, name);
+}
+
+
+/*
+** Fill 'top' with the indices of the (at most NHOTSPOTS) largest
+** non-zero entries in 'counters', in decreasing order; return how many
+** were found.
+*/
+static int hotspots (const unsigned long *counters, int n, int *top) {
+  int i, ntop = 0;
+  for (i = 0; i < n; i++) {
+    int j;
+    if (counters[i] == 0 ||
+        (ntop == NHOTSPOTS && counters[i] <= counters[top[ntop - 1]]))
+      continue;
+    if (ntop < NHOTSPOTS) ntop++;
+    for (j = ntop - 1; j > 0 && counters[top[j - 1]] < counters[i]; j--)
+      top[j] = top[j - 1];  /* open space for new entry */
+    top[j] = i;
+  }
+  return ntop;
+}
+
+
+/*
+** Push the name of the rule containing instruction 'pc' (nil if
+** outside any rule)
+*/
+static void pushruleof (lua_State *L, int names, int pc) {
+  for (; pc >= 0; pc--) {
+    lua_rawgeti(L, names, pc);
+    if (!lua_isnil(L, -1))
+      return;
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+}
+
+
+/*
+** Add to the report (at the top) the fields about backtracking:
+** the restarts per bucket of subject positions and the hot spots,
+** both in positions and in choices.
+*/
+static void backtrackreport (lua_State *L, int names, Profile *prof) {
+  int top[NHOTSPOTS];
+  int i, n;
+  lua_pushinteger(L, prof->maxdepth);
+  lua_setfield(L, -2, "maxdepth");
+  lua_pushinteger(L, (lua_Integer)prof->bucketsize);
+  lua_setfield(L, -2, "bucketsize");
+  lua_createtable(L, prof->nbuckets, 0);
+  for (i = 0; i < prof->nbuckets; i++) {
+    lua_pushnumber(L, (lua_Number)prof->restarts[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "heatmap");
+  n = hotspots(prof->restarts, prof->nbuckets, top);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    size_t from = top[i] * prof->bucketsize;
+    size_t to = from + prof->bucketsize;
+    if (to > prof->npos) to = prof->npos;
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, (lua_Integer)from + 1);
+    lua_setfield(L, -2, "from");
+    lua_pushinteger(L, (lua_Integer)to);
+    lua_setfield(L, -2, "to");
+    lua_pushnumber(L, (lua_Number)prof->restarts[top[i]]);
+    lua_setfield(L, -2, "backtracks");
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "hotpositions");
+  n = hotspots(prof->backtrack, prof->ncode, top);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, top[i]);
+    lua_setfield(L, -2, "pc");
+    lua_pushnumber(L, (lua_Number)prof->backtrack[top[i]]);
+    lua_setfield(L, -2, "backtracks");
+    pushruleof(L, names, top[i]);
+    lua_setfield(L, -2, "rule");
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "hotchoices");
+}
+
+
+/*
+** Push a table with the report for profile 'prof' of code 'op';
+** 'ktable' is the stack index of the pattern's ktable.
+*/
+void profilereport (lua_State *L, const Instruction *op, int ktable,
+                    Profile *prof) {
+  const Instruction *p;
+  int names = rulenames(L, op, prof->ncode, ktable);
+  unsigned long *calls = (unsigned long *)lua_newuserdata(L,
+                             (prof->ncode + 1) * sizeof(unsigned long));
+  unsigned long ninsts = 0, nbacktracks = 0;
+  int i, nrules = 0;
+  countcalls(L, op, names, prof, calls);
+  for (i = 0; i < prof->ncode; i++) {
+    ninsts += prof->count[i];
+    nbacktracks += prof->backtrack[i];
+  }
+  lua_newtable(L);  /* report */
+  lua_pushnumber(L, (lua_Number)ninsts);
+  lua_setfield(L, -2, "instructions");
+  lua_pushnumber(L, (lua_Number)nbacktracks);
+  lua_setfield(L, -2, "backtracks");
+  lua_pushnumber(L, (lua_Number)prof->lrentries);
+  lua_setfield(L, -2, "lrentries");
+  lua_pushnumber(L, (lua_Number)prof->lrgrowths);
+  lua_setfield(L, -2, "lrgrowths");
+  lua_pushnumber(L, (lua_Number)prof->lrcapbytes);
+  lua_setfield(L, -2, "lrcapbytes");
+  setcounters(L, "count", prof->count, prof->ncode);
+  setcounters(L, "choices", prof->backtrack, prof->ncode);
+  lua_newtable(L);  /* rules */
+  for (p = op; p < op + prof->ncode; p += sizei(p)) {
+    int pc = (int)(p - op);
+    lua_rawgeti(L, names, pc);
+    if (lua_isnil(L, -1)) {  /* not a rule? */
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_newtable(L);
+    lua_insert(L, -2);
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, pc);
+    lua_setfield(L, -2, "pc");
+    lua_pushnumber(L, (lua_Number)prof->insts[pc]);
+    lua_setfield(L, -2, "instructions");
+    lua_pushnumber(L, (lua_Number)prof->bytes[pc]);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)calls[pc]);
+    lua_setfield(L, -2, "calls");
+    lua_rawseti(L, -2, ++nrules);
+  }
+  lua_setfield(L, -2, "rules");
+  backtrackreport(L, names, prof);
+  pushlisting(L, op, names, prof);
+  lua_setfield(L, -2, "listing");
+  lua_remove(L, names);
+  lua_remove(L, names);  /* remove 'calls' */
+}
+
+/* }====================================================== */
+
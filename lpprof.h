@@ -0,0 +1,56 @@
+/*
+** Profiling of pattern matching
+*/
+
+#if !defined(lpprof_h)
+#define lpprof_h
+
+#include "lua.h"
+
+#include "lpcap.h"
+#include "lpvm.h"
+
+
+/*
+** Counters collected by the instrumented virtual machine. Arrays
+** 'count' and 'backtrack' are indexed by instruction; arrays 'insts'
+** and 'bytes' are indexed by rule, which is identified by the address
+** of its first instruction (0 stands for code outside any rule).
+** Array 'restarts' is indexed by buckets of 'bucketsize' subject
+** positions, so that its size does not depend on the subject.
+*/
+typedef struct Profile {
+  int ncode;  /* size of the profiled code */
+  int rule;  /* rule being executed */
+  unsigned long *count;  /* times each instruction was executed */
+  unsigned long *backtrack;  /* times each choice was backtracked to */
+  unsigned long *insts;  /* instructions executed inside each rule */
+  unsigned long *bytes;  /* bytes matched by each rule */
+  unsigned long *restarts;  /* backtracks to each bucket of positions */
+  size_t npos;  /* number of subject positions (its length + 1) */
+  size_t bucketsize;  /* number of positions in each bucket */
+  int nbuckets;  /* number of buckets */
+  int maxdepth;  /* maximum depth reached by the backtrack stack */
+  unsigned long lrentries;  /* entries created for left-recursive calls */
+  unsigned long lrgrowths;  /* times a left-recursive seed grew */
+  unsigned long lrcapbytes;  /* bytes of captures copied from seeds */
+  int capmark;  /* (number of captures before copying a seed's ones) */
+} Profile;
+
+
+/* maximum number of buckets of subject positions */
+#define MAXBUCKETS	1024
+
+/* number of entries in lists of hot spots */
+#define NHOTSPOTS	10
+
+
+Profile *newprofile (lua_State *L, int ncode, size_t len);
+void profilereport (lua_State *L, const Instruction *code, int ktable,
+                    Profile *prof);
+const char *profmatch (lua_State *L, const char *o, const char *s,
+                       const char *e, Instruction *op, Capture *capture,
+                       int ptop, Stats *stats, Profile *prof);
+
+#endif
+
@@ -0,0 +1,80 @@
+/*
+** Tracing of pattern matching
+*/
+
+#include <limits.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lptrace.h"
+
+
+static const char *const kindnames[] = {"inst", "fail", "lrgrow"};
+
+
+/*
+** Create a new trace for a ring buffer with 'size' events or (when
+** 'fn' is true) for a function. The trace (and its buffer) live in a
+** userdata pushed on the stack.
+*/
+Trace *newtrace (lua_State *L, int size, int fn) {
+  Trace *trace = (Trace *)lua_newuserdata(L, sizeof(Trace) +
+                                             size * sizeof(TraceEvent));
+  trace->fn = fn;
+  trace->size = size;
+  trace->count = 0;
+  trace->ring = (TraceEvent *)(trace + 1);
+  return trace;
+}
+
+
+/*
+** Send an event to the trace
+*/
+void traceevent (lua_State *L, Trace *trace, int kind, int pc, int pos,
+                 int depth, int captop) {
+  if (!trace->fn) {
+    TraceEvent *ev = &trace->ring[trace->count % trace->size];
+    ev->kind = kind; ev->pc = pc; ev->pos = pos;
+    ev->depth = depth; ev->captop = captop;
+  }
+  else {
+    lua_pushlightuserdata(L, trace);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushstring(L, kindnames[kind]);
+    lua_pushinteger(L, pc);
+    lua_pushinteger(L, pos);
+    lua_pushinteger(L, depth);
+    lua_pushinteger(L, captop);
+    lua_call(L, 5, 0);
+  }
+  trace->count++;
+}
+
+
+/*
+** Push the result of a trace: for a ring buffer, a string with its
+** events, from the oldest to the newest; for a function, the number
+** of events sent to it.
+*/
+void pushtrace (lua_State *L, Trace *trace) {
+  if (!trace->fn) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    if (trace->count <= (unsigned long)trace->size)
+      luaL_addlstring(&b, (const char *)trace->ring,
+                          trace->count * sizeof(TraceEvent));
+    else {  /* buffer wrapped around */
+      int first = (int)(trace->count % trace->size);  /* oldest event */
+      luaL_addlstring(&b, (const char *)(trace->ring + first),
+                          (trace->size - first) * sizeof(TraceEvent));
+      luaL_addlstring(&b, (const char *)trace->ring,
+                          first * sizeof(TraceEvent));
+    }
+    luaL_pushresult(&b);
+  }
+  else
+    lua_pushinteger(L, (lua_Integer)trace->count);
+}
@@ -0,0 +1,61 @@
+/*
+** Tracing of pattern matching
+*/
+
+#if !defined(lptrace_h)
+#define lptrace_h
+
+#include <limits.h>
+
+#include "lua.h"
+
+#include "lpcap.h"
+#include "lpvm.h"
+
+
+/* kinds of trace events */
+#define TRACEINST	0	/* an instruction is about to run */
+#define TRACEFAIL	1	/* the match backtracked (pc -1: it failed) */
+#define TRACELRGROW	2	/* the seed of a left-recursive rule grew */
+
+
+/*
+** One event, as kept in the ring buffer and in the string returned by
+** 'lpeg.trace'
+*/
+typedef struct TraceEvent {
+  int kind;
+  int pc;  /* address of the instruction */
+  int pos;  /* position in the subject (1-based) */
+  int depth;  /* number of entries in the backtrack stack */
+  int captop;  /* number of entries in the current capture list */
+} TraceEvent;
+
+
+/*
+** Where the traced virtual machine sends its events: a ring buffer
+** keeping the last 'size' events or, when 'fn' is true, a function
+** called with each event (kept in the registry, with the address of
+** the trace as its key).
+*/
+typedef struct Trace {
+  int fn;
+  int size;  /* size of 'ring' */
+  unsigned long count;  /* number of events so far */
+  TraceEvent *ring;
+} Trace;
+
+
+/* maximum size for the ring buffer */
+#define MAXTRACE	(INT_MAX / (int)sizeof(TraceEvent))
+
+
+Trace *newtrace (lua_State *L, int size, int fn);
+void traceevent (lua_State *L, Trace *trace, int kind, int pc, int pos,
+                 int depth, int captop);
+void pushtrace (lua_State *L, Trace *trace);
+const char *tracematch (lua_State *L, const char *o, const char *s,
+                        const char *e, Instruction *op, Capture *capture,
+                        int ptop, Stats *stats, Trace *trace);
+
+#endif
@@ -0,0 +1,91 @@
+-- Rendering of traces from 'lpeg.trace'
+
+-- imported functions and modules
+local string, table, type, ipairs, assert = string, table, type, ipairs, assert
+local tonumber = tonumber
+local m = require"lpeg"
+
+
+-- No more global accesses after this point
+local version = _VERSION
+if version == "Lua 5.2" then _ENV = nil end
+
+
+-- names of the kinds of events (see lptrace.h)
+local kindnames = {[0] = "inst", "fail", "lrgrow"}
+
+-- format of an event in a ring-buffer trace (see 'TraceEvent')
+local evformat = "=iiiii"
+
+
+-- convert a trace from a ring buffer into a list of events
+local function decode (s)
+  assert(string.unpack, "decoding a trace needs Lua 5.3 or newer")
+  local size = string.packsize(evformat)
+  local events = {}
+  for i = 1, #s - size + 1, size do
+    local kind, pc, pos, depth, captop = string.unpack(evformat, s, i)
+    events[#events + 1] = {kind = kindnames[kind], pc = pc, pos = pos,
+                           depth = depth, captop = captop}
+  end
+  return events
+end
+
+
+-- map each address of the code of 'p' to its instruction and rule,
+-- reading the listing of 'lpeg.profile' (from a match against the
+-- empty subject); 'p' may also be such a listing
+local function code (p)
+  local listing = type(p) == "string" and p or m.profile(p, "").listing
+  local insts = {}
+  local rule = ""
+  for line in listing:gmatch("[^\n]+") do
+    local pc, inst = line:match("^ *%d+ +%d* +(%d%d%d%d+)  (.-) *$")
+    if pc then
+      insts[tonumber(pc)] = {inst = inst, rule = rule}
+    else
+      rule = line:match("^(%S.*):$") or rule
+    end
+  end
+  return insts
+end
+
+
+-- at most 'n' characters of 'subject' from position 'pos', quoted
+local function excerpt (subject, pos, n)
+  local s = string.format("%q", subject:sub(pos, pos + n - 1))
+  return (s:gsub("\\\n", "\\n"))
+end
+
+
+-- render a trace of a match of 'p' against 'subject': one line per
+-- event, with the position, depth of the backtrack stack, number of
+-- captures, address, rule and instruction, and the subject ahead;
+-- 'events' may be a string from a ring buffer or a list of events
+-- (e.g., collected by a function given to 'lpeg.trace')
+local function render (p, events, subject)
+  if type(events) == "string" then events = decode(events) end
+  local insts = code(p)
+  local out = {"kind    pos  depth  caps  addr  rule: instruction  subject"}
+  for _, ev in ipairs(events) do
+    local i = insts[ev.pc] or {inst = "(end of match)", rule = ""}
+    out[#out + 1] = string.format("%-6s %5d  %5d %5d  %4s  %s: %s  %s",
+                                  ev.kind, ev.pos, ev.depth, ev.captop,
+                                  ev.pc >= 0 and string.format("%04d", ev.pc)
+                                             or "",
+                                  i.rule, i.inst,
+                                  subject and excerpt(subject, ev.pos, 10) or "")
+  end
+  return table.concat(out, "\n")
+end
+
+
+-- exported names
+local lptrace = {
+  decode = decode,
+  render = render,
+}
+
+if version == "Lua 5.1" then _G.lptrace = lptrace end
+
+return lptrace
@@ -5,6 +5,7 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stddef.h>
 #include <string.h>
 
 
@@ -15,6 +16,8 @@
 #include "lpcap.h"
 #include "lpcode.h"
 #include "lpprint.h"
+#include "lpprof.h"
+#include "lptrace.h"
 #include "lptree.h"
 
 
@@ -27,11 +30,12 @@ const byte numsiblings[] = {
   1, 1,		/* not, and */
   0, 0, 2, 1,  /* call, opencall, rule, grammar */
   1,  /* behind */
-  1, 1  /* capture, runtime capture */
+  1, 1,  /* capture, runtime capture */
+  1  /* memo */
 };
 
 
-static TTree *newgrammar (lua_State *L, int arg);
+static TTree *newgrammar (lua_State *L, int arg, Phases *ph);
 
 
 /*
@@ -127,6 +131,230 @@ static void finalfix (lua_State *L, int postable, TTree *g, TTree *t) {
 
 
 
+/*
+** {======================================================
+** Left factoring of choices
+**
+** A run of consecutive alternatives with a common prefix 'x',
+**   x r1 / x r2 / ... / x rk / rest
+** becomes
+**   x (r1 / r2 / ... / rk) / rest
+** which is equivalent when 'x' has no captures (nor match-time
+** captures): as 'x' always matches the same way at a given position,
+** the other alternatives would only match 'x' again. Prefixes with
+** calls to left-recursive rules are not factored. The pass runs after
+** 'finalfix', so it must keep calls pointing to their rules when it
+** moves subtrees.
+** =======================================================
+*/
+
+/*
+** Number of slots of tree 't'
+*/
+static int treesize (TTree *t) {
+  int size = 0;
+  for (;;) {
+    switch (numsiblings[t->tag]) {
+      case 0:
+        return size + ((t->tag == TSet) ? bytes2slots(CHARSETSIZE) + 1 : 1);
+      case 1: size += 1; t = sib1(t); break;
+      default: size += t->u.ps; t = sib2(t); break;  /* (skip 'sib1') */
+    }
+  }
+}
+
+
+/*
+** Check whether trees 't1' and 't2' are equal, with no calls to
+** left-recursive rules. (Captures and grammars are never considered
+** equal.)
+*/
+static int sametree (TTree *t1, TTree *t2) {
+ tailcall:
+  if (t1->tag != t2->tag) return 0;
+  switch (t1->tag) {
+    case TChar: case TBehind:
+      if (t1->u.n != t2->u.n) return 0;
+      break;
+    case TSet:
+      return memcmp(treebuffer(t1), treebuffer(t2), CHARSETSIZE) == 0;
+    case TCall:
+      return (sib2(t1) == sib2(t2) && t1->lr == 0 && t2->lr == 0);
+    case TCapture: case TRunTime: case TOpenCall: case TGrammar:
+      return 0;
+    default: break;
+  }
+  switch (numsiblings[t1->tag]) {
+    case 1:  /* return sametree(sib1(t1), sib1(t2)); */
+      t1 = sib1(t1); t2 = sib1(t2); goto tailcall;
+    case 2:
+      if (!sametree(sib1(t1), sib1(t2))) return 0;
+      /* else return sametree(sib2(t1), sib2(t2)); */
+      t1 = sib2(t1); t2 = sib2(t2); goto tailcall;
+    default: return 1;
+  }
+}
+
+
+/*
+** Tree 't', with 'n' slots starting at 'base', was moved 'delta'
+** slots; correct its calls to rules outside it (that is, not in a
+** grammar inside it).
+*/
+static void fixmovedcalls (TTree *base, TTree *t, int n, int delta) {
+ tailcall:
+  if (t->tag == TCall) {
+    int rule = (int)(t - base) + t->u.ps;  /* rule's position in 'base' */
+    if (rule < 0 || rule >= n)  /* outside the moved tree? */
+      t->u.ps -= delta;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:  /* fixmovedcalls(base, sib1(t), n, delta); */
+      t = sib1(t); goto tailcall;
+    case 2:
+      fixmovedcalls(base, sib1(t), n, delta);
+      t = sib2(t); goto tailcall;  /* fixmovedcalls(base, sib2(t), ...); */
+    default: break;
+  }
+}
+
+
+/*
+** Copy tree 'src', with 'n' slots, to 'buff[i]', for a tree whose
+** final place will be 't + i'. Return the slot after the copy.
+*/
+static int placetree (TTree *buff, TTree *t, int i, TTree *src, int n) {
+  memcpy(buff + i, src, n * sizeof(TTree));
+  fixmovedcalls(buff + i, buff + i, n, (int)((t + i) - src));
+  return i + n;
+}
+
+
+/*
+** Place the alternatives of 'r' in the chain of choices being built
+** at 'buff[i]'. If 'more' is false, 'r' ends the chain and goes as it
+** is; otherwise, each of its alternatives gets a choice in the chain
+** (so that the chain stays right associative).
+*/
+static int placealts (TTree *buff, TTree *t, int i, TTree *r, int more) {
+  if (!more)
+    return placetree(buff, t, i, r, treesize(r));
+  for (;;) {
+    TTree *alt = (r->tag == TChoice) ? sib1(r) : r;
+    int n = treesize(alt);
+    buff[i].tag = TChoice;
+    buff[i].u.ps = n + 1;
+    i = placetree(buff, t, i + 1, alt, n);
+    if (alt == r) return i;
+    r = sib2(r);
+  }
+}
+
+
+/*
+** Factor the longest run of alternatives with a common prefix at the
+** start of the chain of choices 't'. The new tree is built in 'buff'
+** and copied over the old one, with this layout:
+**   [choice] seq x choice r1 ... choice r(k-1) rk [gap] [rest]
+** where the first choice exists only when the run does not end the
+** chain; 'rest' is not moved. Return the number of alternatives in
+** the run (0 if none).
+*/
+static int factorrun (TTree *t, TTree *buff) {
+  TTree *x = sib1(sib1(t));
+  TTree *c = t;  /* last choice in the run */
+  TTree *last = NULL;  /* last alternative, when it is in the run */
+  TTree *rest, *a;
+  int k = 1;
+  int i;
+  if (sib1(t)->tag != TSeq || hascaptures(NULL, x))
+    return 0;
+  for (;;) {  /* find the run */
+    TTree *next = sib2(c);
+    if (next->tag == TChoice && sib1(next)->tag == TSeq &&
+        sametree(x, sib1(sib1(next)))) {
+      c = next; k++;
+    }
+    else {
+      if (next->tag == TSeq && sametree(x, sib1(next))) {
+        last = next; k++;
+      }
+      break;
+    }
+  }
+  if (k == 1) return 0;
+  rest = (last == NULL) ? sib2(c) : NULL;
+  i = (rest != NULL);  /* leave room for the choice with 'rest' */
+  buff[i].tag = TSeq;
+  buff[i].u.ps = treesize(x) + 1;
+  i = placetree(buff, t, i + 1, x, buff[i].u.ps - 1);
+  for (a = t; ; a = sib2(a)) {
+    i = placealts(buff, t, i, sib2(sib1(a)), a != c || last != NULL);
+    if (a == c) break;
+  }
+  if (last != NULL)
+    i = placealts(buff, t, i, sib2(last), 0);
+  else {
+    buff[0].tag = TChoice;
+    buff[0].u.ps = (int)(rest - t);
+    assert(i <= buff[0].u.ps);
+  }
+  memcpy(t, buff, i * sizeof(TTree));
+  return k;
+}
+
+
+#if defined(LPEG_DEBUG)
+/*
+** Print the prefix of the 'k' alternatives just factored at 't'
+** (for 'lpeg.ptree')
+*/
+static void reportfactor (TTree *t, int k) {
+  printf("factored prefix of %d alternatives:\n", k);
+  printtree(sib1((t->tag == TSeq) ? t : sib1(t)), 2);
+}
+#else
+#define reportfactor(t,k)	((void)0)
+#endif
+
+
+/*
+** Factor the choices in tree 't', using 'buff' (with as many slots
+** as the whole tree) to build the new subtrees. If 'report' is true,
+** print the prefixes factored.
+*/
+static void factortree (TTree *t, TTree *buff, int report) {
+ tailcall:
+  if (t->tag == TChoice) {
+    int k = factorrun(t, buff);
+    if (k > 0 && report)
+      reportfactor(t, k);
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:  /* factortree(sib1(t), buff, report); */
+      t = sib1(t); goto tailcall;
+    case 2:
+      factortree(sib1(t), buff, report);
+      t = sib2(t); goto tailcall;  /* factortree(sib2(t), buff, report); */
+    default: break;
+  }
+}
+
+
+/*
+** Left factoring of the choices in pattern tree 'tree', with 'size'
+** slots
+*/
+static void leftfactor (lua_State *L, TTree *tree, int size, int report) {
+  TTree *buff = (TTree *)lua_newuserdata(L, size * sizeof(TTree));
+  factortree(tree, buff, report);
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {===================================================================
 ** KTable manipulation
@@ -462,7 +690,7 @@ static TTree *getpatt (lua_State *L, int idx, int *len) {
       break;
     }
     case LUA_TTABLE: {
-      tree = newgrammar(L, idx);
+      tree = newgrammar(L, idx, NULL);
       break;
     }
     case LUA_TFUNCTION: {
@@ -483,6 +711,21 @@ static TTree *getpatt (lua_State *L, int idx, int *len) {
 }
 
 
+/*
+** create a new (not compiled) pattern with a copy of the tree of the
+** pattern at index 'idx', sharing its 'ktable'; the copy is left at
+** the top of the stack.
+*/
+static Pattern *copypattern (lua_State *L, int idx) {
+  int n;
+  TTree *tree1 = getpatt(L, idx, &n);
+  TTree *tree = newtree(L, n);
+  memcpy(tree, tree1, n * sizeof(TTree));
+  copyktable(L, idx);
+  return getpattern(L, -1);
+}
+
+
 /*
 ** create a new tree, whith a new root and one sibling.
 ** Sibling must be on the Lua stack, at index 1.
@@ -556,21 +799,174 @@ static int lp_choice (lua_State *L) {
     TTree *t = newcharset(L);
     loopset(i, treebuffer(t)[i] = st1.cs[i] | st2.cs[i]);
   }
-  else
-  {
-  if (hasleftrecursion(t1) || hasleftrecursion(t2))
-    newroot2sib(L, TChoice);
   else if (nofail(t1) || t2->tag == TFalse)
     lua_pushvalue(L, 1);  /* true / x => true, x / false => x */
   else if (t1->tag == TFalse)
     lua_pushvalue(L, 2);  /* false / x => x */
   else
     newroot2sib(L, TChoice);
- }
   return 1;
 }
 
 
+/*
+** N-ary sequences and choices ('lpeg.seq' and 'lpeg.choice').
+** Stack: 1 - list of items; 2 - list of patterns to be joined;
+** 3 - new pattern; 4 - ktable merged last
+*/
+
+/*
+** Replace the k-th pattern in the list at index 2 by a charset
+** pattern with set 'cs'; return the size of the new pattern.
+*/
+static int replacebyset (lua_State *L, int k, const Charset *cs) {
+  int size;
+  TTree *tree = newcharset(L);
+  loopset(i, treebuffer(tree)[i] = cs->cs[i]);
+  size = getsize(L, -1);
+  lua_rawseti(L, 2, k);
+  return size;
+}
+
+
+/*
+** Collect into the list at index 2 the items (converted to patterns)
+** that matter in a sequence ('tag' == TSeq) or in a choice, with the
+** optimizations of 'lp_seq' and 'lp_choice': a sequence skips true
+** items and stops after a false one; a choice skips false items,
+** stops after an item that cannot fail, and joins consecutive
+** charsets into a single one. Return the number of collected patterns;
+** '*size' gets the sum of their sizes.
+*/
+static int collectitems (lua_State *L, int tag, int *size) {
+  int n = lua_rawlen(L, 1);
+  int k = 0;  /* number of collected patterns */
+  int lastsize = 0;  /* size of the last one */
+  int inset = 0;  /* last one is a charset? (2 if joined with others) */
+  Charset cs, st;
+  int i;
+  *size = 0;
+  for (i = 1; i <= n; i++) {
+    int len;
+    TTree *t;
+    lua_rawgeti(L, 1, i);
+    t = getpatt(L, lua_gettop(L), &len);
+    if (t->tag == (tag == TSeq ? TTrue : TFalse)) {  /* neutral item? */
+      lua_pop(L, 1);  /* skip it */
+      continue;
+    }
+    if (tag == TChoice && tocharset(t, &st)) {
+      if (inset) {  /* last one is also a charset? */
+        loopset(j, cs.cs[j] |= st.cs[j]);  /* join them */
+        inset = 2;
+        lua_pop(L, 1);
+        continue;
+      }
+      cs = st;
+      inset = 1;
+    }
+    else if (inset) {
+      if (inset == 2)
+        *size += replacebyset(L, k, &cs) - lastsize;
+      inset = 0;
+    }
+    lua_rawseti(L, 2, ++k);  /* collect pattern */
+    *size += lastsize = len;
+    if (tag == TSeq ? t->tag == TFalse : nofail(t))
+      break;  /* following items are irrelevant */
+  }
+  if (inset == 2)
+    *size += replacebyset(L, k, &cs) - lastsize;
+  return k;
+}
+
+
+/*
+** Merge the ktable of the pattern at index 'idx', copied into 'tree',
+** into the ktable of the new pattern. As in 'joinktables', a ktable
+** equal to the one merged last is reused; '*offset' keeps the
+** correction for its keys.
+*/
+static void mergeitemktable (lua_State *L, int idx, TTree *tree,
+                             int *offset) {
+  lua_getuservalue(L, idx);
+  if (ktablelen(L, -1) == 0)  /* no keys to correct? */
+    lua_pop(L, 1);
+  else {
+    if (!lp_equal(L, -1, 4)) {  /* not the ktable merged last? */
+      lua_getuservalue(L, 3);
+      *offset = concattable(L, -2, -1);
+      lua_pop(L, 1);  /* remove new ktable */
+      lua_replace(L, 4);  /* this ktable is now the one merged last */
+    }
+    else
+      lua_pop(L, 1);
+    correctkeys(tree, *offset);
+  }
+}
+
+
+/*
+** Copy the 'k' patterns from the list at index 2 into 'tree', joined
+** by 'tag' nodes. The result is already right associative, as
+** 'correctassociativity' would leave it: p1 op (p2 op (... op pk)).
+*/
+static void buildnary (lua_State *L, int tag, int k, TTree *tree) {
+  int offset = 0;  /* key correction for the ktable merged last */
+  int i;
+  for (i = 1; i <= k; i++) {
+    int len;
+    TTree *t;
+    lua_rawgeti(L, 2, i);
+    t = gettree(L, -1, &len);
+    if (i < k) {  /* not the last one? */
+      tree->tag = tag;
+      tree->u.ps = len + 1;
+      tree = sib1(tree);
+    }
+    memcpy(tree, t, len * sizeof(TTree));
+    mergeitemktable(L, lua_gettop(L), tree, &offset);
+    lua_pop(L, 1);
+    tree += len;  /* next free slot: sibling 2 of the last 'tag' node */
+  }
+}
+
+
+/*
+** Join all items in a list with 'tag' (TSeq or TChoice) in a single
+** new pattern, copying each item only once.
+*/
+static int naryaux (lua_State *L, int tag) {
+  int size, k;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_newtable(L);  /* list of patterns to be joined */
+  k = collectitems(L, tag, &size);
+  if (k == 0)  /* empty sequence (or choice)? */
+    newleaf(L, (tag == TSeq) ? TTrue : TFalse);
+  else if (k == 1)
+    lua_rawgeti(L, 2, 1);  /* the single pattern is the result */
+  else {
+    TTree *tree = newtree(L, size + k - 1);
+    newktable(L, 0);
+    lua_pushnil(L);  /* no ktable merged yet */
+    buildnary(L, tag, k, tree);
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+
+static int lp_seqn (lua_State *L) {
+  return naryaux(L, TSeq);
+}
+
+
+static int lp_choicen (lua_State *L) {
+  return naryaux(L, TChoice);
+}
+
+
 /*
 ** p^n
 */
@@ -687,7 +1083,7 @@ static int lp_behind (lua_State *L) {
   TTree *tree1 = getpatt(L, 1, NULL);
   int n = fixedlen(tree1);
   luaL_argcheck(L, n >= 0, 1, "pattern may not have fixed length");
-  luaL_argcheck(L, !hascaptures(tree1), 1, "pattern have captures");
+  luaL_argcheck(L, !hascaptures(NULL, tree1), 1, "pattern have captures");
   luaL_argcheck(L, n <= MAXBEHIND, 1, "pattern too long to look behind");
   tree = newroot1sib(L, TBehind);
   tree->u.n = n;
@@ -695,6 +1091,17 @@ static int lp_behind (lua_State *L) {
 }
 
 
+/*
+** Memoized rule: calls to a rule whose pattern is 'Memo(p)' keep
+** their results, so that the rule runs only once at each position
+** (see 'IMemoCall'). Anywhere else, 'Memo(p)' is just 'p'.
+*/
+static int lp_memo (lua_State *L) {
+  newroot1sib(L, TMemo);
+  return 1;
+}
+
+
 /*
 ** Create a non-terminal
 */
@@ -955,54 +1362,87 @@ static void buildgrammar (lua_State *L, TTree *grammar, int frule, int n) {
 
 
 /*
-** Check whether a tree has potential infinite loops
+** Grammar verification, in three passes over the rules, each visiting
+** a rule once (in practice): the first one computes which rules are
+** nullable; the second finds the left-recursive rules; the third one
+** checks for empty loops and marks the calls to left-recursive rules.
+** The first two passes find the strongly connected components of a
+** graph whose vertices are the rules (with Tarjan's algorithm), with
+** an edge from each rule to each rule it may call without consuming
+** any input (its "left calls"). In the first pass, all calls are
+** assumed nullable when deciding which calls are left calls, as the
+** nullability of the rules is not known yet. A rule is left recursive
+** when it reaches a cycle of left calls.
 */
-static int checkloops (TTree *tree) {
- tailcall:
-  if (tree->tag == TRep && nullable(sib1(tree)))
-    return 1;
-  else if (tree->tag == TGrammar)
-    return 0;  /* sub-grammars already checked */
-  else {
-    switch (numsiblings[tree->tag]) {
-      case 1:  /* return checkloops(sib1(tree)); */
-        tree = sib1(tree); goto tailcall;
-      case 2:
-        if (checkloops(sib1(tree))) return 1;
-        /* else return checkloops(sib2(tree)); */
-        tree = sib2(tree); goto tailcall;
-      default: assert(numsiblings[tree->tag] == 0); return 0;
-    }
-  }
-}
 
+/* results of 'verifyrule' */
+#define VNnullable	1  /* pattern is nullable */
+#define VNmaybe		2  /* nullable if all calls are nullable */
 
-static int verifyerror (lua_State *L, int *passed, int npassed) {
-  int i, j;
-  for (i = npassed - 1; i >= 0; i--) {  /* search for a repetition */
-    for (j = i - 1; j >= 0; j--) {
-      if (passed[i] == passed[j]) {
-//      lua_rawgeti(L, -1, passed[i]);  /* get rule's key */
-//      return luaL_error(L, "rule '%s' may be left recursive", val2str(L, -1));
-        return PEleftrecursion;
-      }
-    }
+/* values of 'RuleInfo.state' */
+#define VRnew		0  /* not visited yet (in this pass) */
+#define VRbusy		1  /* rule being visited */
+#define VRdone		2  /* rule visited */
+
+typedef struct RuleInfo {
+  int index;  /* order of the visit to the rule */
+  int low;  /* lowest 'index' reachable from it in the stack */
+  byte state;
+  byte onstack;  /* rule is in the stack of components */
+  byte cycle;  /* rule calls a rule in its component */
+  byte nullable;
+} RuleInfo;
+
+
+typedef struct VerifyState {
+  lua_State *L;
+  int ktable;  /* stack index of the 'ktable' */
+  int firstpass;  /* computing nullability (first pass)? */
+  TTree *grammar;
+  RuleInfo *rules;  /* one entry for each rule */
+  int *rulenum;  /* number of each rule (indexed by its position) */
+  TTree **stack;  /* stack of components */
+  int top;
+  int nvisited;
+} VerifyState;
+
+
+#define getruleinfo(vs,r)  (&(vs)->rules[(vs)->rulenum[(r) - (vs)->grammar]])
+
+
+static void visitrule (VerifyState *vs, TTree *rule);
+
+
+/*
+** Edge from 'rule' to 'callee'; return the nullability of the call
+** (as far as known).
+*/
+static int callrule (VerifyState *vs, TTree *rule, TTree *callee) {
+  RuleInfo *ri = getruleinfo(vs, rule);
+  RuleInfo *ci = getruleinfo(vs, callee);
+  if (ci->state == VRnew) {
+    visitrule(vs, callee);
+    if (ci->low < ri->low) ri->low = ci->low;
   }
-  return luaL_error(L, "too many left calls in grammar");
+  else if (ci->onstack) {  /* callee in the component of 'rule'? */
+    if (ci->index < ri->low) ri->low = ci->index;
+    ri->cycle = 1;
+  }
+  if (callee->lr)
+    rule->lr = 1;
+  return (ci->nullable ? VNnullable : 0) | VNmaybe;
 }
 
 
 /*
-** Check whether a rule can be left recursive; raise an error in that
-** case; otherwise return 1 iff pattern is nullable.
-** The return value is used to check sequences, where the second pattern
-** is only relevant if the first is nullable.
+** Visit the left calls in 'tree', in rule 'rule'; return its
+** nullability (VNnullable and VNmaybe bits). The return value is used
+** to check sequences, where the second pattern is only relevant if the
+** first is nullable (or maybe nullable, in the first pass).
 ** Parameter 'nb' works as an accumulator, to allow tail calls in
-** choices. ('nb' true makes function returns true.)
-** Assume ktable at the top of the stack.
+** choices. (Bits in 'nb' are added to the result.)
 */
-static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
-                       int nb) {
+static int verifyrule (VerifyState *vs, TTree *rule, TTree *tree, int nb) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
@@ -1010,80 +1450,180 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
       return nb;  /* cannot pass from here */
     case TTrue:
     case TBehind:  /* look-behind cannot have calls */
-      return 1;
+      return VNnullable | VNmaybe;
     case TNot: case TAnd: case TRep:
-      /* return verifyrule(L, sib1(tree), passed, npassed, 1); */
-      tree = sib1(tree); nb = 1; goto tailcall;
-    case TCapture: case TRunTime:
-      /* return verifyrule(L, sib1(tree), passed, npassed, nb); */
+      /* return verifyrule(vs, rule, sib1(tree), VNnullable | VNmaybe); */
+      tree = sib1(tree); nb = VNnullable | VNmaybe; goto tailcall;
+    case TCapture: case TRunTime: case TMemo:
+      /* return verifyrule(vs, rule, sib1(tree), nb); */
       tree = sib1(tree); goto tailcall;
     case TCall:
-      /* return verifyrule(L, sib2(tree), passed, npassed, nb); */
-      tree = sib2(tree); goto tailcall;
-    case TSeq:  /* only check 2nd child if first is nb */
-      switch (verifyrule(L, sib1(tree), passed, npassed, 0)) {
-        case 0: return nb;
-        case PEleftrecursion: return PEleftrecursion;
-      /* else return verifyrule(L, sib2(tree), passed, npassed, nb); */
-      }
+      return callrule(vs, rule, sib2(tree)) | nb;
+    case TSeq: {  /* only check 2nd child if first is nb */
+      int n1 = verifyrule(vs, rule, sib1(tree), 0);
+      if (n1 == VNmaybe && vs->firstpass)  /* may 2nd child have left calls? */
+        return (verifyrule(vs, rule, sib2(tree), 0) & VNmaybe) | nb;
+      else if (!(n1 & VNnullable))
+        return nb;
+      /* else return verifyrule(vs, rule, sib2(tree), nb); */
       tree = sib2(tree); goto tailcall;
+    }
     case TChoice:  /* must check both children */
-      nb = verifyrule(L, sib1(tree), passed, npassed, nb);
-      if (nb == PEleftrecursion) return PEleftrecursion;
-      /* return verifyrule(L, sib2(tree), passed, npassed, nb); */
+      nb = verifyrule(vs, rule, sib1(tree), nb);
+      /* return verifyrule(vs, rule, sib2(tree), nb); */
       tree = sib2(tree); goto tailcall;
-    case TRule:
-      if (npassed >= MAXRULES)
-        return verifyerror(L, passed, npassed);
-      else {
-        passed[npassed++] = tree->key;
-        /* return verifyrule(L, sib1(tree), passed, npassed); */
-        tree = sib1(tree); goto tailcall;
-      }
-    case TGrammar:
-      return nullable(tree);  /* sub-grammar cannot be left recursive */
+    case TGrammar:  /* sub-grammar cannot be left recursive */
+      return (nullable(tree) ? VNnullable | VNmaybe : 0) | nb;
     default: assert(0); return 0;
   }
 }
 
+
 /*
-**
-**
-**
+** Nullability of the rules in a component with a cycle (from 'base'
+** to the top of the stack): a call to a rule in the component assumed
+** it to be not nullable, so repeat their visits until no rule becomes
+** nullable. (Rules only go from not nullable to nullable.)
+*/
+static void cyclenullable (VerifyState *vs, int base) {
+  int changed;
+  vs->firstpass = 0;  /* all its left calls were already visited */
+  do {
+    int i;
+    changed = 0;
+    for (i = vs->top - 1; i >= base; i--) {
+      TTree *r = vs->stack[i];
+      RuleInfo *ri = getruleinfo(vs, r);
+      if (!ri->nullable && (verifyrule(vs, r, sib1(r), 0) & VNnullable)) {
+        ri->nullable = 1;
+        changed = 1;
+      }
+    }
+  } while (changed);
+  vs->firstpass = 1;
+}
+
+
+/*
+** Visit 'rule' and the rules it reaches. When 'rule' is the root of a
+** component, compute the nullability of its rules (first pass) or
+** make all of them left recursive if any of them is (second pass).
+*/
+static void visitrule (VerifyState *vs, TTree *rule) {
+  RuleInfo *ri = getruleinfo(vs, rule);
+  int base = vs->top;
+  ri->index = ri->low = ++vs->nvisited;
+  ri->state = VRbusy;
+  ri->onstack = 1;
+  vs->stack[vs->top++] = rule;
+  ri->nullable = verifyrule(vs, rule, sib1(rule), 0) & VNnullable;
+  ri->state = VRdone;
+  if (!vs->firstpass && ri->cycle)
+    rule->lr = 1;  /* a cycle of left calls */
+  if (ri->low == ri->index) {  /* root of a component? */
+    if (vs->firstpass && (vs->top - base > 1 || ri->cycle))
+      cyclenullable(vs, base);
+    while (vs->top > base) {  /* pop its rules */
+      TTree *r = vs->stack[--vs->top];
+      getruleinfo(vs, r)->onstack = 0;
+      if (!vs->firstpass) r->lr = rule->lr;
+    }
+  }
+}
+
+
+/*
+** Check whether a tree has potential infinite loops, raising an error
+** in that case; mark calls to left-recursive rules; return 1 iff tree
+** is nullable.
 */
-static void findleftrecursivecalls (TTree *tree) {
+static int checkloops (VerifyState *vs, TTree *rule, TTree *tree) {
  tailcall:
-  if (tree->tag == TCall && sib2(tree)->lr && !tree->lr)
-   tree->lr = 1; //Call may be left recursive
-  switch (numsiblings[tree->tag]) {
-    case 1:  /* findleftrecursivecalls(sib1(tree)); */
+  switch (tree->tag) {
+    case TChar: case TSet: case TAny:
+    case TFalse:
+      return 0;
+    case TTrue:
+      return 1;
+    case TRep:
+      if (checkloops(vs, rule, sib1(tree))) {
+        lua_rawgeti(vs->L, vs->ktable, rule->key);  /* get rule's key */
+        luaL_error(vs->L, "empty loop in rule '%s'", val2str(vs->L, -1));
+      }
+      return 1;
+    case TNot: case TAnd: case TBehind:
+      checkloops(vs, rule, sib1(tree));
+      return 1;
+    case TCapture: case TRunTime: case TMemo:
+      /* return checkloops(vs, rule, sib1(tree)); */
       tree = sib1(tree); goto tailcall;
-    case 2:
-      findleftrecursivecalls(sib1(tree));
-      tree = sib2(tree); goto tailcall;  /* findleftrecursivecalls(sib2(tree)); */
-    default: assert(numsiblings[tree->tag] == 0); break;
+    case TCall:
+      if (sib2(tree)->lr && !tree->lr)  /* ('lr' may keep a precedence) */
+        tree->lr = 1;  /* call may be left recursive */
+      return getruleinfo(vs, sib2(tree))->nullable;
+    case TSeq: {
+      int n1 = checkloops(vs, rule, sib1(tree));
+      return checkloops(vs, rule, sib2(tree)) && n1;
+    }
+    case TChoice: {
+      int n1 = checkloops(vs, rule, sib1(tree));
+      return checkloops(vs, rule, sib2(tree)) || n1;
+    }
+    case TGrammar:
+      return nullable(tree);  /* sub-grammars already checked */
+    default: assert(0); return 0;
+  }
+}
+
+
+/*
+** Visit all (used) rules of 'grammar', in one of the first two passes
+*/
+static void visitrules (VerifyState *vs, int firstpass) {
+  TTree *rule;
+  vs->firstpass = firstpass;
+  vs->top = vs->nvisited = 0;
+  for (rule = sib1(vs->grammar); rule->tag == TRule; rule = sib2(rule)) {
+    RuleInfo *ri = getruleinfo(vs, rule);
+    ri->state = VRnew;
+    ri->onstack = ri->cycle = 0;
+  }
+  for (rule = sib1(vs->grammar); rule->tag == TRule; rule = sib2(rule)) {
+    if (rule->key == 0) continue;  /* unused rule */
+    if (getruleinfo(vs, rule)->state == VRnew)
+      visitrule(vs, rule);
   }
 }
 
-static void verifygrammar (lua_State *L, TTree *grammar) {
-  int passed[MAXRULES];
+
+/*
+** Verify the grammar 'grammar', with 'n' rules and 'size' slots.
+** Assume ktable at the top of the stack.
+*/
+static void verifygrammar (lua_State *L, TTree *grammar, int n, int size) {
+  VerifyState vs;
   TTree *rule;
-  /* check left-recursive rules */
+  int i = 0;
+  vs.L = L;
+  vs.ktable = lua_gettop(L);
+  vs.grammar = grammar;
+  vs.stack = (TTree **)lua_newuserdata(L, n * sizeof(TTree *) +
+                              n * sizeof(RuleInfo) + size * sizeof(int));
+  vs.rules = (RuleInfo *)(vs.stack + n);
+  vs.rulenum = (int *)(vs.rules + n);
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
-    if (rule->key == 0) continue;  /* unused rule */
-    rule->lr = verifyrule(L, sib1(rule), passed, 0, 0) == PEleftrecursion ? 1 : 0;
+    vs.rulenum[rule - grammar] = i;
+    vs.rules[i++].nullable = 0;
   }
-  assert(rule->tag == TTrue);
+  assert(i == n);
+  visitrules(&vs, 1);  /* compute nullable rules */
+  visitrules(&vs, 0);  /* check left-recursive rules */
   /* check infinite loops inside rules */
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
     if (rule->key == 0) continue;  /* unused rule */
-    findleftrecursivecalls(sib1(rule));
-    if (checkloops(sib1(rule))) {
-      lua_rawgeti(L, -1, rule->key);  /* get rule's key */
-      luaL_error(L, "empty loop in rule '%s'", val2str(L, -1));
-    }
+    checkloops(&vs, rule, sib1(rule));
   }
-  assert(rule->tag == TTrue);
+  lua_pop(L, 1);  /* remove 'vs' arrays */
 }
 
 
@@ -1100,7 +1640,12 @@ static void initialrulename (lua_State *L, TTree *grammar, int frule) {
 }
 
 
-static TTree *newgrammar (lua_State *L, int arg) {
+/*
+** Build a grammar from the table at index 'arg'; when 'ph' is not
+** NULL, add the time spent in each phase to it
+*/
+static TTree *newgrammar (lua_State *L, int arg, Phases *ph) {
+  clock_t t = (ph != NULL) ? clock() : 0;
   int treesize;
   int frule = lua_gettop(L) + 2;  /* position of first rule's key */
   int n = collectrules(L, arg, &treesize);
@@ -1111,9 +1656,12 @@ static TTree *newgrammar (lua_State *L, int arg) {
   lua_setuservalue(L, -2);
   buildgrammar(L, g, frule, n);
   lua_getuservalue(L, -1);  /* get 'ktable' for new tree */
+  phasetime(ph, grammar, t);
   finalfix(L, frule - 1, g, sib1(g));
   initialrulename(L, g, frule);
-  verifygrammar(L, g);
+  phasetime(ph, finalfix, t);
+  verifygrammar(L, g, n, treesize);
+  phasetime(ph, verify, t);
   lua_pop(L, 1);  /* remove 'ktable' */
   lua_insert(L, -(n * 2 + 2));  /* move new table to proper position */
   lua_pop(L, n * 2 + 1);  /* remove position table + rule pairs */
@@ -1123,21 +1671,68 @@ static TTree *newgrammar (lua_State *L, int arg) {
 /* }====================================================== */
 
 
-static Instruction *prepcompile (lua_State *L, Pattern *p, int idx) {
+/*
+** Push a copy of tree 'tree', with 'size' slots, in a userdata;
+** return the copy
+*/
+static TTree *copytree (lua_State *L, TTree *tree, int size) {
+  TTree *copy = (TTree *)lua_newuserdata(L, size * sizeof(TTree));
+  memcpy(copy, tree, size * sizeof(TTree));
+  return copy;
+}
+
+
+/*
+** Compile pattern 'p' (at index 'idx') with optimization level 'level'.
+** Left factoring (done only at level 2) changes the tree, so it works
+** on a copy, used only to generate the code; the tree of the pattern
+** is left as it was built.
+*/
+static Instruction *compileat (lua_State *L, Pattern *p, int idx,
+                               int level, Phases *ph) {
+  clock_t t = (ph != NULL) ? clock() : 0;
+  int size = getsize(L, idx);
+  TTree *tree = p->tree;
+  Instruction *code;
   lua_getuservalue(L, idx);  /* push 'ktable' (may be used by 'finalfix') */
   finalfix(L, 0, NULL, p->tree);
   lua_pop(L, 1);  /* remove 'ktable' */
-  return compile(L, p);
+  if (level >= 2) {
+    tree = copytree(L, p->tree, size);
+    leftfactor(L, tree, size, 0);
+  }
+  phasetime(ph, finalfix, t);
+  code = compile(L, p, tree, size, level, ph);
+  if (level >= 2)
+    lua_pop(L, 1);  /* remove copy of the tree */
+  return code;
+}
+
+
+/*
+** Compile pattern 'p' (at index 'idx') with the optimization level in
+** effect
+*/
+static Instruction *prepcompile (lua_State *L, Pattern *p, int idx,
+                                 Phases *ph) {
+  int level;
+  lua_getfield(L, LUA_REGISTRYINDEX, OPTLEVELIDX);
+  level = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return compileat(L, p, idx, level, ph);
 }
 
 
 static int lp_printtree (lua_State *L) {
-  TTree *tree = getpatt(L, 1, NULL);
+  int size;
+  TTree *tree = getpatt(L, 1, &size);
   int c = lua_toboolean(L, 2);
   if (c) {
     lua_getuservalue(L, 1);  /* push 'ktable' (may be used by 'finalfix') */
     finalfix(L, 0, NULL, tree);
     lua_pop(L, 1);  /* remove 'ktable' */
+    tree = copytree(L, tree, size);  /* factor (and print) a copy */
+    leftfactor(L, tree, size, 1);
   }
   printktable(L, 1);
   printtree(tree, 0);
@@ -1145,11 +1740,77 @@ static int lp_printtree (lua_State *L) {
 }
 
 
+/*
+** lpeg.compilestats(p): compile a copy of 'p', returning the compiled
+** copy and a table with the processor time (in seconds) spent in each
+** phase and the sizes of the tree and of the code. When 'p' is a table,
+** the times to build the grammar are included. ('p' itself may be in
+** use by a match, so its code is left alone.)
+*/
+static int lp_compilestats (lua_State *L) {
+  Phases ph = {0, 0, 0, 0, 0, 0};
+  Pattern *p;
+  int nodes;
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  if (lua_istable(L, 1)) {  /* a grammar? */
+    newgrammar(L, 1, &ph);
+    lua_replace(L, 1);
+  }
+  getpatt(L, 1, &nodes);
+  p = copypattern(L, 1);
+  prepcompile(L, p, 2, &ph);
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, (lua_Number)ph.grammar / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "grammar");
+  lua_pushnumber(L, (lua_Number)ph.finalfix / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "finalfix");
+  lua_pushnumber(L, (lua_Number)ph.verify / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "verify");
+  lua_pushnumber(L, (lua_Number)ph.analysis / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "analysis");
+  lua_pushnumber(L, (lua_Number)ph.codegen / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "codegen");
+  lua_pushnumber(L, (lua_Number)ph.peephole / CLOCKS_PER_SEC);
+  lua_setfield(L, -2, "peephole");
+  lua_pushinteger(L, nodes);
+  lua_setfield(L, -2, "nodes");
+  lua_pushinteger(L, p->codesize);
+  lua_setfield(L, -2, "codesize");
+  return 2;
+}
+
+
+/*
+** lpeg.compile(p [, level]): compile a copy of 'p' with the given
+** optimization level (default: the level in effect), returning the
+** compiled copy ('p' itself may be in use by a match)
+*/
+static int lp_compile (lua_State *L) {
+  Pattern *p;
+  int level;
+  luaL_checkany(L, 1);
+  if (lua_isnoneornil(L, 2)) {
+    lua_getfield(L, LUA_REGISTRYINDEX, OPTLEVELIDX);
+    level = (int)lua_tointeger(L, -1);
+  }
+  else {
+    lua_Integer l = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 0 <= l && l <= MAXOPTLEVEL, 2, "out of range");
+    level = (int)l;
+  }
+  lua_settop(L, 1);
+  p = copypattern(L, 1);
+  compileat(L, p, 2, level, NULL);
+  return 1;
+}
+
+
 static int lp_printcode (lua_State *L) {
   Pattern *p = getpattern(L, 1);
   printktable(L, 1);
   if (p->code == NULL)  /* not compiled yet? */
-    prepcompile(L, p, 1);
+    prepcompile(L, p, 1, NULL);
   printpatt(p->code, p->codesize);
   return 0;
 }
@@ -1175,29 +1836,242 @@ static size_t initposition (lua_State *L, size_t len) {
 
 
 /*
-** Main match function
+** Counters and budget of all matches in the Lua state (see 'Stats')
 */
-static int lp_match (lua_State *L) {
+static Stats *getstats (lua_State *L) {
+  Stats *stats;
+  lua_getfield(L, LUA_REGISTRYINDEX, STATSIDX);
+  stats = (Stats *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return stats;
+}
+
+
+/*
+** Match the pattern at index 1 against the subject at index 2; when
+** 'prof' is not NULL, run the instrumented machine, collecting counts
+** into it; when 'trace' is not NULL, run the traced machine, sending
+** events to it.
+*/
+static int domatch (lua_State *L, Profile *prof, Trace *trace) {
   Capture capture[INITCAPSIZE];
   const char *r;
   size_t l;
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
-  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1, NULL);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
   size_t i = initposition(L, l);
   int ptop = lua_gettop(L);
+  Stats *stats;
+  luaL_argcheck(L, l < MAXINDT, SUBJIDX, "subject too long");
+  stats = getstats(L);
+  stats->matches++;
+  stats->bytes += l - i;
   lua_pushnil(L);  /* initialize subscache */
   lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
   lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  if (prof != NULL)
+    r = profmatch(L, s, s + i, s + l, code, capture, ptop, stats, prof);
+  else if (trace != NULL)
+    r = tracematch(L, s, s + i, s + l, code, capture, ptop, stats, trace);
+  else if (stats->budget == 0)  /* no budget? */
+    r = match(L, s, s + i, s + l, code, capture, ptop, stats);
+  else
+    r = budgetmatch(L, s, s + i, s + l, code, capture, ptop, stats);
   if (r == NULL) {
+    stats->failures++;
     lua_pushnil(L);
     return 1;
   }
+  else if (r == EXHAUSTED) {
+    stats->failures++;
+    lua_pushboolean(L, 0);
+    return 1;
+  }
   return getcaptures(L, s, r, ptop);
 }
 
 
+/*
+** Main match function
+*/
+static int lp_match (lua_State *L) {
+  return domatch(L, NULL, NULL);
+}
+
+
+static int profmatch_aux (lua_State *L) {
+  return domatch(L, (Profile *)lua_touserdata(L, lua_upvalueindex(1)), NULL);
+}
+
+
+static int tracematch_aux (lua_State *L) {
+  return domatch(L, NULL, (Trace *)lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+
+#if LUA_VERSION_NUM >= 503
+
+static int yieldmatch_k (lua_State *L, int status, lua_KContext ctx);
+
+
+/*
+** Run a yieldable match until it ends or suspends
+*/
+static int runyieldmatch (lua_State *L, MatchState *ms) {
+  const char *r = resumematch(L, ms);
+  if (r == SUSPENDED)
+    return lua_yieldk(L, 0, 0, yieldmatch_k);
+  else if (r == NULL) {
+    ms->stats->failures++;
+    lua_pushnil(L);
+    return 1;
+  }
+  else if (r == EXHAUSTED) {
+    ms->stats->failures++;
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  return getcaptures(L, ms->o, r, ms->ptop);
+}
+
+
+/*
+** Continue a match after a yield: either the machine suspended itself
+** (and the values given to 'resume' are dropped) or a match-time capture
+** yielded and has now returned its results.
+*/
+static int yieldmatch_k (lua_State *L, int status, lua_KContext ctx) {
+  MatchState *ms = (MatchState *)lua_touserdata(L, lua_upvalueindex(1));
+  (void)status; (void)ctx;  /* not used */
+  if (!ms->runtime)  /* suspended by the machine? */
+    lua_settop(L, ms->top);
+  return runyieldmatch(L, ms);
+}
+
+
+static int yieldmatch_aux (lua_State *L) {
+  MatchState *ms = (MatchState *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t l;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1, NULL);
+  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  size_t i = initposition(L, l);
+  Stats *stats;
+  luaL_argcheck(L, l < MAXINDT, SUBJIDX, "subject too long");
+  stats = getstats(L);
+  stats->matches++;
+  stats->bytes += l - i;
+  ms->stats = stats;
+  ms->ptop = lua_gettop(L);
+  ms->o = s; ms->e = s + l; ms->op = code;
+  ms->k = yieldmatch_k;
+  lua_getfield(L, LUA_REGISTRYINDEX, YIELDSTEPSIDX);
+  ms->period = lua_isyieldable(L) ? (long)lua_tointeger(L, -1) : 0;
+  lua_pop(L, 1);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_newuserdata(L, INITCAPSIZE * sizeof(Capture));  /* caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  startmatch(L, s + i, ms);
+  return runyieldmatch(L, ms);
+}
+
+
+static int yieldmatch_end (lua_State *L, int status, lua_KContext ctx) {
+  (void)status; (void)ctx;  /* not used */
+  return lua_gettop(L);  /* return all results of the match */
+}
+
+
+/*
+** lpeg.yieldmatch(p, subject [, init, ...]): a match that can yield.
+** The match runs in a separate call (like in 'lp_profile'), whose
+** upvalue keeps its 'MatchState'.
+*/
+static int lp_yieldmatch (lua_State *L) {
+  int n = lua_gettop(L);
+  lua_newuserdata(L, sizeof(MatchState));
+  lua_pushcclosure(L, yieldmatch_aux, 1);
+  lua_insert(L, 1);
+  lua_callk(L, n, LUA_MULTRET, 0, yieldmatch_end);
+  return yieldmatch_end(L, LUA_OK, 0);
+}
+
+#endif
+
+
+/*
+** lpeg.profile(p, subject [, init, ...]): match with the instrumented
+** machine and return a report of the match followed by its results.
+** The match runs in a separate call, so that its stack layout is the
+** same as in 'lp_match'; the profile stays below it.
+*/
+static int lp_profile (lua_State *L) {
+  int n = lua_gettop(L);
+  size_t l;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  luaL_checklstring(L, SUBJIDX, &l);
+  if (p->code == NULL)  /* not compiled yet? */
+    prepcompile(L, p, 1, NULL);
+  newprofile(L, p->codesize, l);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, profmatch_aux, 1);
+  lua_insert(L, 1);  /* function to be called */
+  lua_insert(L, 1);  /* profile */
+  lua_pushvalue(L, 3);  /* pattern */
+  lua_insert(L, 2);  /* keep it for the report */
+  lua_call(L, n, LUA_MULTRET);  /* stack: profile, pattern, results... */
+  lua_getuservalue(L, 2);  /* ktable */
+  profilereport(L, p->code, lua_gettop(L), (Profile *)lua_touserdata(L, 1));
+  lua_remove(L, -2);  /* remove ktable */
+  lua_replace(L, 2);  /* report replaces pattern */
+  lua_remove(L, 1);  /* remove profile */
+  return lua_gettop(L);
+}
+
+
+/*
+** lpeg.trace(sink, p, subject [, init, ...]): match with the traced
+** machine, sending its events to 'sink' (the size of a ring buffer or
+** a function), and return the trace followed by the results of the
+** match. As in 'lp_profile', the match runs in a separate call; it
+** runs protected, so that the function always leaves the registry.
+*/
+static int lp_trace (lua_State *L) {
+  int n = lua_gettop(L) - 1;  /* number of arguments to the match */
+  int fn = lua_isfunction(L, 1);
+  int size = 0;
+  int status;
+  Trace *trace;
+  if (!fn) {
+    lua_Integer lim = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, 0 < lim && lim <= MAXTRACE, 1, "out of range");
+    size = (int)lim;
+  }
+  trace = newtrace(L, size, fn);
+  if (fn) {
+    lua_pushlightuserdata(L, trace);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);  /* registry[trace] = function */
+  }
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, tracematch_aux, 1);
+  lua_replace(L, 1);  /* function to be called replaces sink */
+  lua_insert(L, 1);  /* trace */
+  status = lua_pcall(L, n, LUA_MULTRET, 0);  /* stack: trace, results... */
+  if (fn) {
+    lua_pushlightuserdata(L, trace);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);  /* remove function from registry */
+  }
+  if (status != 0)
+    lua_error(L);
+  pushtrace(L, trace);
+  lua_replace(L, 1);  /* result of the trace replaces it */
+  return lua_gettop(L);
+}
+
+
 
 /*
 ** {======================================================
@@ -1217,6 +2091,97 @@ static int lp_setmax (lua_State *L) {
 }
 
 
+static int lp_setmaxcapdepth (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 < lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXCAPDEPTHIDX);
+  return 0;
+}
+
+
+/*
+** lpeg.stats([reset]): return a table with the counters of all
+** matches so far; if 'reset' is true, zero them after that
+*/
+static int lp_stats (lua_State *L) {
+  Stats *stats = getstats(L);
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, (lua_Integer)stats->matches);
+  lua_setfield(L, -2, "matches");
+  lua_pushinteger(L, (lua_Integer)stats->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, (lua_Integer)stats->failures);
+  lua_setfield(L, -2, "failures");
+  lua_pushinteger(L, (lua_Integer)stats->stackgrowths);
+  lua_setfield(L, -2, "stackgrowths");
+  lua_pushinteger(L, (lua_Integer)stats->capgrowths);
+  lua_setfield(L, -2, "capgrowths");
+  lua_pushinteger(L, (lua_Integer)stats->lrgrowths);
+  lua_setfield(L, -2, "lrgrowths");
+  lua_pushinteger(L, (lua_Integer)stats->cmtcalls);
+  lua_setfield(L, -2, "cmtcalls");
+  lua_pushinteger(L, (lua_Integer)stats->maxstack);
+  lua_setfield(L, -2, "maxstack");
+  if (lua_toboolean(L, 1))  /* reset the counters (not the budget)? */
+    memset(stats, 0, offsetof(Stats, budget));
+  return 1;
+}
+
+
+static int lp_setbudget (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim, 1, "out of range");
+  getstats(L)->budget = lim;
+  return 0;
+}
+
+
+static int lp_setyieldsteps (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, YIELDSTEPSIDX);
+  return 0;
+}
+
+
+static int lp_setmemosize (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MEMOSIZEIDX);
+  return 0;
+}
+
+
+static int lp_setsharesize (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, SHARESIZEIDX);
+  return 0;
+}
+
+
+static int lp_setinlinesize (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, INLINESIZEIDX);
+  return 0;
+}
+
+
+static int lp_setoptlevel (lua_State *L) {
+  lua_Integer level = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= level && level <= MAXOPTLEVEL, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, OPTLEVELIDX);
+  return 0;
+}
+
+
 static int lp_version (lua_State *L) {
   lua_pushstring(L, VERSION);
   return 1;
@@ -1276,7 +2241,15 @@ static struct luaL_Reg pattreg[] = {
   {"ptree", lp_printtree},
   {"pcode", lp_printcode},
   {"match", lp_match},
+  {"profile", lp_profile},
+  {"trace", lp_trace},
+  {"compilestats", lp_compilestats},
+  {"compile", lp_compile},
+#if LUA_VERSION_NUM >= 503
+  {"yieldmatch", lp_yieldmatch},
+#endif
   {"B", lp_behind},
+  {"Memo", lp_memo},
   {"V", lp_V},
   {"C", lp_simplecapture},
   {"Cc", lp_constcapture},
@@ -1289,11 +2262,21 @@ static struct luaL_Reg pattreg[] = {
   {"Cf", lp_foldcapture},
   {"Cg", lp_groupcapture},
   {"P", lp_P},
+  {"seq", lp_seqn},
+  {"choice", lp_choicen},
   {"S", lp_set},
   {"R", lp_range},
   {"locale", lp_locale},
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
+  {"setmaxcapdepth", lp_setmaxcapdepth},
+  {"setbudget", lp_setbudget},
+  {"setyieldsteps", lp_setyieldsteps},
+  {"setmemosize", lp_setmemosize},
+  {"setsharesize", lp_setsharesize},
+  {"setinlinesize", lp_setinlinesize},
+  {"setoptlevel", lp_setoptlevel},
+  {"stats", lp_stats},
   {"type", lp_type},
   {NULL, NULL}
 };
@@ -1317,6 +2300,25 @@ int luaopen_lpeg (lua_State *L) {
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);  /* initialize maximum backtracking */
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  lua_pushnumber(L, MAXCAPDEPTH);  /* initialize maximum capture depth */
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXCAPDEPTHIDX);
+  lua_pushinteger(L, YIELDSTEPS);  /* initialize steps between yields */
+  lua_setfield(L, LUA_REGISTRYINDEX, YIELDSTEPSIDX);
+  lua_pushinteger(L, MEMOSIZE);  /* initialize size of memos */
+  lua_setfield(L, LUA_REGISTRYINDEX, MEMOSIZEIDX);
+  lua_pushinteger(L, SHARESIZE);  /* initialize size of shared subtrees */
+  lua_setfield(L, LUA_REGISTRYINDEX, SHARESIZEIDX);
+  lua_pushinteger(L, INLINESIZE);  /* initialize size of inlined rules */
+  lua_setfield(L, LUA_REGISTRYINDEX, INLINESIZEIDX);
+  lua_pushinteger(L, OPTLEVEL);  /* initialize optimization level */
+  lua_setfield(L, LUA_REGISTRYINDEX, OPTLEVELIDX);
+  lua_getfield(L, LUA_REGISTRYINDEX, STATSIDX);
+  if (lua_isnil(L, -1)) {  /* no counters yet? (library may be reopened) */
+    memset(lua_newuserdata(L, sizeof(Stats)), 0, sizeof(Stats));
+    lua_setfield(L, LUA_REGISTRYINDEX, STATSIDX);
+  }
+  lua_pop(L, 1);
+  getstats(L)->budget = 0;  /* initialize budget of steps (no limit) */
   luaL_setfuncs(L, metareg, 0);
   luaL_newlib(L, pattreg);
   lua_pushvalue(L, -1);
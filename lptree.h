@@ -24,7 +24,8 @@ typedef enum TTag {
   TGrammar,  /* sib1 is initial (and first) rule */
   TBehind,  /* match behind */
   TCapture,  /* regular capture */
-  TRunTime  /* run-time capture */
+  TRunTime,  /* run-time capture */
+  TMemo  /* memoized rule (see 'lpeg.Memo') */
 } TTag;
 
 /* number of siblings for each tree */
@@ -24,6 +24,13 @@
 
 #define PATTERN_T	"lpeg-pattern"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define MAXCAPDEPTHIDX	"lpeg-maxcapdepth"
+#define YIELDSTEPSIDX	"lpeg-yieldsteps"
+#define MEMOSIZEIDX	"lpeg-memosize"
+#define SHARESIZEIDX	"lpeg-sharesize"
+#define INLINESIZEIDX	"lpeg-inlinesize"
+#define OPTLEVELIDX	"lpeg-optlevel"
+#define STATSIDX	"lpeg-stats"
 
 
 /*
@@ -55,6 +62,48 @@
 #endif
 
 
+/* default number of instructions between yields (see 'lpeg.yieldmatch') */
+#if !defined(YIELDSTEPS)
+#define YIELDSTEPS      100000
+#endif
+
+/* default number of entries in the memo of a match (see 'lpeg.Memo') */
+#if !defined(MEMOSIZE)
+#define MEMOSIZE        1024
+#endif
+
+/* default minimum size (in tree slots) of a repeated subtree coded
+   only once, as a subroutine (0 for none; see 'lpeg.setsharesize') */
+#if !defined(SHARESIZE)
+#define SHARESIZE       64
+#endif
+
+/* default maximum size (in tree slots) of a rule inlined in its calls
+   (0 for none; see 'lpeg.setinlinesize') */
+#if !defined(INLINESIZE)
+#define INLINESIZE      16
+#endif
+
+/* default optimization level of the compiler, up to MAXOPTLEVEL
+   (see 'lpeg.setoptlevel') */
+#if !defined(OPTLEVEL)
+#define OPTLEVEL        2
+#endif
+
+#define MAXOPTLEVEL     2
+
+/* default maximum nesting depth for capture evaluation */
+#if !defined(MAXCAPDEPTH)
+#define MAXCAPDEPTH     200000
+#endif
+
+
+/* maximum nesting of string and substitution captures */
+#if !defined(MAXSTRCAPNEST)
+#define MAXSTRCAPNEST   200
+#endif
+
+
 /* maximum number of rules in a grammar */
 #if !defined(MAXRULES)
 #define MAXRULES        1000
@@ -65,6 +114,9 @@
 /* initial size for capture's list */
 #define INITCAPSIZE	32
 
+/* initial size for the stack of captures being evaluated */
+#define INITCAPFRAMES	32
+
 /* initial size for capture stack's list */
 #define INITCAPSTACKSIZE	32
 
@@ -95,6 +147,25 @@
 /* index, on Lua stack, for dyn captures stack */
 #define dyncaplistidx(ptop)	((ptop) + 8)
 
+/*
+** index, on Lua stack, for the capture-shape counts used when
+** evaluating captures (reuses the slot of the backtracking stack,
+** which is free once the match is over)
+*/
+#define shapeidx(ptop)	stackidx(ptop)
+
+/*
+** index, on Lua stack, for the frames used when evaluating captures
+** (reuses the slot of lambda, also free once the match is over)
+*/
+#define frameidx(ptop)	lambdaidx(ptop)
+
+/*
+** index, on Lua stack, for the resolution of back references (reuses
+** the slot of the captures array, free once the match is over)
+*/
+#define backrefidx(ptop)	caplistsidx(ptop)
+
 typedef unsigned char byte;
 
 
@@ -14,6 +14,21 @@
 #include "lptypes.h"
 #include "lpvm.h"
 #include "lpprint.h"
+#if defined(LPEG_PROFILE)
+#include "lpprof.h"
+#define LPEG_BUDGET	/* profiled matches also obey the budget */
+#endif
+#if defined(LPEG_TRACE)
+#include "lptrace.h"
+#define LPEG_BUDGET	/* traced matches also obey the budget */
+#endif
+#if defined(LPEG_YIELD)
+#define LPEG_BUDGET	/* yieldable matches also obey the budget */
+#endif
+
+
+/* (yieldable matches need continuations, which Lua has from 5.3 on) */
+#if !defined(LPEG_YIELD) || LUA_VERSION_NUM >= 503
 
 
 /* initial size for call/backtrack stack */
@@ -23,6 +38,9 @@
 
 #define LRFAIL	-1
 
+/* 'caplevel' of the stack entry of a left-recursive call */
+#define LRCALL	-1
+
 #define getoffset(p)	(((p) + 1)->offset)
 
 static const Instruction giveup = {{IGiveup, 0, 0}};
@@ -38,19 +56,107 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 typedef struct Stack {
   const char *s;  /* saved position (or NULL for calls) */
   const Instruction *p;  /* next instruction */
-  int caplevel;
-  const char *X; /* LR */
-  const Instruction *pA;
+  int caplevel;  /* (or LRCALL for left-recursive calls) */
+#if defined(LPEG_PROFILE)
+  int site;  /* choice instruction that pushed the entry */
+  int rule;  /* rule running when the entry was pushed */
+  const char *start;  /* position of a call */
+#endif
 } Stack;
 
 
+/*
+** Hooks for the instrumented version of the virtual machine ('profmatch',
+** compiled from this same file with LPEG_PROFILE defined); they keep
+** their counts in 'prof' (see lpprof.h). In the regular version they
+** do nothing.
+*/
+#if defined(LPEG_PROFILE)
+
+#define profinst(p)  \
+	{ if ((p) != &giveup) { prof->count[(p) - op]++; prof->insts[prof->rule]++; } }
+#define profchoice(st,pc)	{ (st)->site = (pc); (st)->rule = prof->rule; }
+#define profcall(st,target,s)  \
+	{ (st)->rule = prof->rule; (st)->start = (s); prof->rule = (target); }
+#define profret(st,e)  \
+	{ prof->bytes[prof->rule] += (e) - (st)->start; prof->rule = (st)->rule; }
+#define profrestart(st)  \
+	{ if ((st)->p != &giveup) { prof->backtrack[(st)->site]++;  \
+	    prof->restarts[((st)->s - o) / prof->bucketsize]++; }  \
+	  prof->rule = (st)->rule; }
+#define profdepth(st)  \
+	{ int d_ = (st) - getstackbase(L, ptop) + 1;  \
+	  if (d_ > prof->maxdepth) prof->maxdepth = d_; }
+#define profbytes(rule,n)	(prof->bytes[rule] += (n))
+#define proflrentry()		(prof->lrentries++)
+#define proflrgrow()		(prof->lrgrowths++)
+#define proflrmark()		(prof->capmark = captop)
+#define proflrcopied()  \
+	(prof->lrcapbytes += (captop - prof->capmark) * sizeof(Capture))
+
+#else
+
+#define profinst(p)		((void)0)
+#define profchoice(st,pc)	((void)0)
+#define profcall(st,target,s)	((void)0)
+#define profret(st,e)		((void)0)
+#define profrestart(st)		((void)0)
+#define profdepth(st)		((void)0)
+#define profbytes(rule,n)	((void)0)
+#define proflrentry()		((void)0)
+#define proflrgrow()		((void)0)
+#define proflrmark()		((void)0)
+#define proflrcopied()		((void)0)
+
+#endif
+
+
+/*
+** Hooks for the traced version of the virtual machine ('tracematch',
+** compiled with LPEG_TRACE); they send events to 'trace' (see
+** lptrace.h). In the other versions they do nothing.
+*/
+#if defined(LPEG_TRACE)
+
+#define tracepc(p)	(((p) == &giveup) ? -1 : (int)((p) - op))
+#define traceev(kind,p)  \
+	traceevent(L, trace, kind, tracepc(p), (int)(s - o) + 1,  \
+	           (int)(stack - getstackbase(L, ptop)), captop)
+#define traceinst(p)	{ if ((p) != &giveup) traceev(TRACEINST, p); }
+#define tracefail()	traceev(TRACEFAIL, p)
+#define tracelrgrow()	traceev(TRACELRGROW, p)
+
+#else
+
+#define traceinst(p)		((void)0)
+#define tracefail()		((void)0)
+#define tracelrgrow()		((void)0)
+
+#endif
+
+
+/*
+** Each left-recursive call has its own list of captures; the state of
+** the enclosing list is saved in an entry of the capture stack, which
+** also keeps the call's bookkeeping (so that entries of the backtrack
+** stack stay small).
+*/
+typedef struct CaptureStack {
+  int captop;
+  int dyncaptop;
+  int capsize;
+  const char *X;  /* LR: end of current seed (or LRFAIL) */
+  const Instruction *pA;  /* LR: called rule */
+} CaptureStack;
+
+
 #define getstackbase(L, ptop)	((Stack *)lua_touserdata(L, stackidx(ptop)))
 
 
 /*
 ** Double the size of the array of captures
 */
-static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop, int capstackptr) {
+static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop, int capstackptr, Stats *stats) {
   Capture *newc;
   if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
     luaL_error(L, "too many captures");
@@ -59,6 +165,7 @@ static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop, int
   lua_replace(L, caplistidx(ptop));
   lua_pushvalue(L, caplistidx(ptop)); // update capture base in Capture Stack
   lua_rawseti(L, caplistsidx(ptop), capstackptr);
+  stats->capgrowths++;
   return newc;
 }
 
@@ -90,7 +197,8 @@ static Capture *newcap (lua_State *L, int size, int ptop, int capstackptr) {
 /*
 ** Double the size of the stack
 */
-static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
+static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop,
+                           Stats *stats) {
   Stack *stack = getstackbase(L, ptop);
   Stack *newstack;
   int n = *stacklimit - stack;  /* current stack size */
@@ -105,6 +213,9 @@ static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
   newstack = (Stack *)lua_newuserdata(L, newn * sizeof(Stack));
   memcpy(newstack, stack, n * sizeof(Stack));
   lua_replace(L, stackidx(ptop));
+  stats->stackgrowths++;
+  if ((unsigned long)newn > stats->maxstack)
+    stats->maxstack = newn;
   *stacklimit = newstack + newn;
   return newstack + n;  /* return next position */
 }
@@ -140,7 +251,7 @@ static int resdyncaptures (lua_State *L, int fr, int curr, int limit) {
 ** 'base', nested inside a group capture. 'fd' indexes the first capture
 ** value, 'n' is the number of values (at least 1).
 */
-static void adddyncaptures (const char *s, Capture *base, int n, int fd) {
+static void adddyncaptures (Index_t s, Capture *base, int n, int fd) {
   int i;
   /* Cgroup capture is already there */
   assert(base[0].kind == Cgroup && base[0].siz == 0);
@@ -149,11 +260,11 @@ static void adddyncaptures (const char *s, Capture *base, int n, int fd) {
     base[i].kind = Cruntime;
     base[i].siz = 1;  /* mark it as closed */
     base[i].idx = fd + i - 1;  /* stack index of capture value */
-    base[i].s = s;
+    base[i].index = s;
   }
   base[i].kind = Cclose;  /* close group */
   base[i].siz = 1;
-  base[i].s = s;
+  base[i].index = s;
 }
 
 
@@ -192,10 +303,11 @@ static Capture* getcapturesfromstack (lua_State *L, int ndyncap, int newdyncap,
 /*
 **
 */
-static CaptureStack * addcapturestostack (lua_State *L, CaptureStack *capstack, int ndyncap, int captop, int *capstacksize, int *capstacktop, int ptop) {
+static CaptureStack * addcapturestostack (lua_State *L, CaptureStack *capstack, int ndyncap, int captop, int capsize, int *capstacksize, int *capstacktop, int ptop) {
    int i;
    capstack->captop = captop;
    capstack->dyncaptop = ndyncap;
+   capstack->capsize = capsize;  /* (the list may have grown) */
    lua_newtable(L);
    for (i = 1; i <= ndyncap; i++)
     {
@@ -228,7 +340,7 @@ static int removecapturesfromstack (lua_State *L, int capstacktop, int ptop) {
 /*
 **
 */
-static void putcapturestolambda (lua_State *L, int ndyncap, int captop, int capstacktop, int ptop) {
+static void putcapturestolambda (lua_State *L, int ndyncap, int captop, int ptop) {
   int i;
   lua_pushvalue(L, caplistidx(ptop));
   lua_setfield(L,-2,"commitcap");
@@ -248,7 +360,7 @@ static void putcapturestolambda (lua_State *L, int ndyncap, int captop, int caps
 /*
 **
 */
-static Capture * addcapturesfromlambda (lua_State *L, int lambdaindex, Capture * capture,  int *ndyncap, int *captop, int *capsize, int capstacktop, int ptop) {
+static Capture * addcapturesfromlambda (lua_State *L, int lambdaindex, Capture * capture,  int *ndyncap, int *captop, int *capsize, int capstacktop, int ptop, Stats *stats) {
   int i, commitdyncapcount, commitcaptop;
   Capture * commitcapture;
   lua_pushinteger(L, lambdaindex);
@@ -266,18 +378,19 @@ static Capture * addcapturesfromlambda (lua_State *L, int lambdaindex, Capture *
     lua_insert(L,-6);
    }
   lua_pop(L,5);
-  for (i = 0; i < commitcaptop; i++)
-    if (commitcapture[i].kind == Cruntime)
-      commitcapture[i].idx += *ndyncap;
-  *ndyncap += commitdyncapcount;
   if (commitcaptop > 0) {
-    if (*captop + commitcaptop >= *capsize) {
-      capture = doublecap(L, capture, *captop + commitcaptop, ptop, capstacktop);
-      *capsize = 2 * (*captop + commitcaptop);
+    while (*captop + commitcaptop >= *capsize) {
+      capture = doublecap(L, capture, *capsize, ptop, capstacktop, stats);
+      *capsize *= 2;
     }
     memcpy(capture + *captop, commitcapture, commitcaptop * sizeof(Capture));
+    /* correct the copies (not the seed, which may be copied again) */
+    for (i = *captop; i < *captop + commitcaptop; i++)
+      if (capture[i].kind == Cruntime)
+        capture[i].idx += *ndyncap;
     *captop += commitcaptop;
   }
+  *ndyncap += commitdyncapcount;
   return capture;
 }
 
@@ -291,11 +404,290 @@ static void clearlambdaitem (lua_State *L, int index, int ptop) {
   lua_settable(L, lambdaidx(ptop));
 }
 
+/*
+** {======================================================
+** Memoized calls (see 'lpeg.Memo')
+** =======================================================
+*/
+
+/* number of captures in the pool of a memo for each of its entries */
+#define MEMOCAPS	4
+
+/* key of the memo of a match in its 'lambda' table */
+#define MEMOKEY		"memo"
+
+
+/*
+** A memo keeps the results of memoized calls, indexed by rule and
+** position, in a table with a fixed number of entries, where a new
+** result replaces any older one in its slot. The captures produced by
+** the calls go into a circular pool, so a result is lost too when its
+** captures are overwritten by newer ones. So, the memory used by a
+** match is bounded, and the memo keeps the most recent results.
+*/
+typedef struct MemoEntry {
+  const Instruction *rule;  /* memoized rule (NULL if entry is empty) */
+  Index_t pos;  /* position of the call */
+  Index_t end;  /* where the call ended (MAXINDT if it failed) */
+  size_t cap;  /* start of its captures in the pool (see 'pooltop') */
+  int ncap;  /* number of its captures */
+} MemoEntry;
+
+typedef struct Memo {
+  unsigned int mask;  /* number of entries - 1 */
+  unsigned int poolsize;  /* size of the pool (a power of 2) */
+  size_t pooltop;  /* number of captures ever added to the pool */
+  MemoEntry *entry;
+  Capture *pool;
+} Memo;
+
+
+#define memoslot(m,pc,pos)  \
+	(&(m)->entry[((pos) ^ ((unsigned int)(pc) * 2654435761u)) & (m)->mask])
+
+
+/*
+** Get the memo of the current match, creating it in its first use;
+** return NULL if memoization is off (memo size 0).
+*/
+static Memo *getmemo (lua_State *L, int ptop) {
+  Memo *memo;
+  lua_getfield(L, lambdaidx(ptop), MEMOKEY);
+  memo = (Memo *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (memo == NULL) {
+    lua_Integer n;
+    unsigned int size = 1;
+    lua_getfield(L, LUA_REGISTRYINDEX, MEMOSIZEIDX);
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (n == 0)  /* memoization is off? */
+      return NULL;
+    while (size < n) size *= 2;
+    memo = (Memo *)lua_newuserdata(L, sizeof(Memo) + size * sizeof(MemoEntry)
+                                   + MEMOCAPS * size * sizeof(Capture));
+    memo->mask = size - 1;
+    memo->poolsize = MEMOCAPS * size;
+    memo->pooltop = 0;
+    memo->entry = (MemoEntry *)(memo + 1);
+    memo->pool = (Capture *)(memo->entry + size);
+    memset(memo->entry, 0, size * sizeof(MemoEntry));
+    lua_setfield(L, lambdaidx(ptop), MEMOKEY);
+  }
+  return memo;
+}
+
+
+/*
+** Find the result of a call to 'rule' at position 'pos' ('pc' is the
+** address of the rule); return NULL if it is not in the memo.
+*/
+static MemoEntry *memolookup (Memo *memo, const Instruction *rule, int pc,
+                              Index_t pos) {
+  MemoEntry *m;
+  if (memo == NULL) return NULL;
+  m = memoslot(memo, pc, pos);
+  if (m->rule != rule || m->pos != pos)
+    return NULL;
+  if (memo->pooltop - m->cap > memo->poolsize)  /* captures overwritten? */
+    return NULL;
+  return m;
+}
+
+
+/*
+** Keep the result of a call to 'rule' at position 'pos': it ended at
+** 'end' (MAXINDT if it failed) with the 'ncap' captures at 'cap'.
+** Results with match-time captures are not kept, as their values live
+** in the Lua stack of the match.
+*/
+static void memostore (Memo *memo, const Instruction *rule, int pc,
+                       Index_t pos, Index_t end, const Capture *cap,
+                       int ncap) {
+  MemoEntry *m;
+  int i;
+  if (memo == NULL || (unsigned int)ncap > memo->poolsize)
+    return;
+  for (i = 0; i < ncap; i++) {
+    if (cap[i].kind == Cruntime)
+      return;
+  }
+  m = memoslot(memo, pc, pos);
+  m->rule = rule; m->pos = pos; m->end = end;
+  m->cap = memo->pooltop; m->ncap = ncap;
+  for (i = 0; i < ncap; i++)
+    memo->pool[memo->pooltop++ & (memo->poolsize - 1)] = cap[i];
+}
+
+
+/*
+** Add the captures of a memoized result to the capture list
+*/
+static Capture *memocaptures (lua_State *L, Memo *memo, MemoEntry *m,
+                              Capture *capture, int *captop, int *capsize,
+                              int ptop, int capstacktop, Stats *stats) {
+  int i;
+  while (*captop + m->ncap >= *capsize) {
+    capture = doublecap(L, capture, *capsize, ptop, capstacktop, stats);
+    *capsize *= 2;
+  }
+  for (i = 0; i < m->ncap; i++)
+    capture[(*captop)++] = memo->pool[(m->cap + i) & (memo->poolsize - 1)];
+  return capture;
+}
+
+/* }====================================================== */
+
+
+/*
+** Budget of steps (see 'lpeg.setbudget'). Only the versions of the
+** virtual machine compiled with LPEG_BUDGET ('budgetmatch', and also
+** 'profmatch', 'tracematch', and 'resumematch') keep the budget; 'match'
+** is used when there is no budget, and so it does not pay for it.
+** (Even a counter in the failure path slows down the machine, as it
+** runs short of registers.)
+*/
+#if defined(LPEG_BUDGET)
+
+/*
+** The budget of steps for a match; no limit (0) becomes a budget too
+** large to be exhausted.
+*/
+static long long getbudget (Stats *stats) {
+  return (stats->budget == 0) ? LLONG_MAX : (long long)stats->budget;
+}
+
+/*
+** Charge the budget for going back from position 'from' to the current
+** position: one step, plus one for each character that will be
+** examined again. A match that never goes back runs in time linear in
+** its subject, so only backtracking (failures, back commits, and
+** growths of left-recursive seeds, which match the seed again) is
+** charged.
+*/
+#define spendsteps(from)  \
+	{ if ((steps -= 1 + (((from) > s) ? (from) - s : 0)) < 0)  \
+	    return EXHAUSTED; }
+
+#else
+
+#define spendsteps(from)	((void)(from))
+
+#endif
+
+
+/*
+** Yieldable matches ('resumematch', compiled with LPEG_YIELD) run from
+** a state saved in a 'MatchState', and return SUSPENDED after saving
+** it back, either every 'period' instructions or when a match-time
+** capture yields. They keep everything else in userdata in the Lua
+** stack, which survives a yield.
+*/
+#if defined(LPEG_YIELD)
+
+#define savestate()  \
+	{ ms->s = s; ms->p = p;  \
+	  ms->stack = stack - getstackbase(L, ptop);  \
+	  ms->stacksize = stacklimit - getstackbase(L, ptop);  \
+	  ms->captop = captop; ms->capsize = capsize; ms->ndyncap = ndyncap;  \
+  ms->steps = steps;  \
+	  ms->capstack = capstack -  \
+	    (CaptureStack *)lua_touserdata(L, capliststackidx(ptop));  \
+	  ms->capstacksize = capstacksize; ms->capstacktop = capstacktop;  \
+	  ms->top = lua_gettop(L); }
+
+/* (after a resume, the current instruction must run before next yield) */
+#define yieldpoint()  \
+	{ if (ms->tick > 0 && --ms->tick == 0) {  \
+	    ms->tick = ms->period + 1; savestate(); return SUSPENDED; } }
+
+
+/*
+** Start a yieldable match at position 's': push the state of the
+** virtual machine, as 'match' does, but with its arrays in userdata;
+** then set 'ms' as if the match were suspended at its first
+** instruction.
+*/
+void startmatch (lua_State *L, const char *s, MatchState *ms) {
+  int ptop = ms->ptop;
+  Stack *stack = (Stack *)lua_newuserdata(L, INITBACK * sizeof(Stack));
+  CaptureStack *capstack;
+  stack->p = &giveup; stack->s = s; stack->caplevel = 0;
+  lua_newtable(L);  /* lambdaidx */
+  lua_newtable(L);  /* caplistsidx */
+  capstack = (CaptureStack *)lua_newuserdata(L, INITCAPSTACKSIZE *
+                                                sizeof(CaptureStack));
+  lua_newtable(L);  /* dyncaplistidx */
+  lua_pushvalue(L, caplistidx(ptop));  /* first list of captures */
+  lua_rawseti(L, caplistsidx(ptop), 1);
+  capstack->captop = 0;
+  capstack->dyncaptop = 0;
+  capstack->capsize = INITCAPSIZE;
+  ms->s = s; ms->p = ms->op;
+  ms->stack = 1; ms->stacksize = INITBACK;
+  ms->captop = 0; ms->capsize = INITCAPSIZE; ms->ndyncap = 0;
+  ms->capstack = 0; ms->capstacksize = INITCAPSTACKSIZE; ms->capstacktop = 1;
+  ms->runtime = 0;
+  ms->tick = ms->period;
+  ms->steps = getbudget(ms->stats);
+}
+
+#else
+
+#define yieldpoint()	((void)0)
+
+#endif
+
+
+#if !defined(LPEG_BUDGET) && !defined(LPEG_YIELD)
+const char budgetexhausted = 0;
+const char matchsuspended = 0;
+#endif
+
+
 /*
 ** Opcode interpreter
 */
+#if defined(LPEG_PROFILE)
+const char *profmatch (lua_State *L, const char *o, const char *s,
+                       const char *e, Instruction *op, Capture *capture,
+                       int ptop, Stats *stats, Profile *prof) {
+#elif defined(LPEG_TRACE)
+const char *tracematch (lua_State *L, const char *o, const char *s,
+                        const char *e, Instruction *op, Capture *capture,
+                        int ptop, Stats *stats, Trace *trace) {
+#elif defined(LPEG_YIELD)
+const char *resumematch (lua_State *L, MatchState *ms) {
+  const char *o = ms->o;
+  const char *s = ms->s;
+  const char *e = ms->e;
+  Instruction *op = ms->op;
+  int ptop = ms->ptop;
+  Stats *stats = ms->stats;
+  Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
+  Stack *stacklimit = getstackbase(L, ptop) + ms->stacksize;
+  Stack *stack = getstackbase(L, ptop) + ms->stack;
+  int capsize = ms->capsize;
+  int captop = ms->captop;
+  int ndyncap = ms->ndyncap;
+  const Instruction *p = ms->p;
+  int maxpointer = e - o;
+  CaptureStack *capstack =
+      (CaptureStack *)lua_touserdata(L, capliststackidx(ptop)) + ms->capstack;
+  int capstacksize = ms->capstacksize;
+  int capstacktop = ms->capstacktop;
+  long long steps = ms->steps;
+  if (ms->runtime)  /* suspended inside a match-time capture? */
+    goto runtimeresult;
+#elif defined(LPEG_BUDGET)
+const char *budgetmatch (lua_State *L, const char *o, const char *s,
+                         const char *e, Instruction *op, Capture *capture,
+                         int ptop, Stats *stats) {
+#else
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+                   Instruction *op, Capture *capture, int ptop, Stats *stats) {
+#endif
+#if !defined(LPEG_YIELD)
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -308,8 +700,12 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   CaptureStack *capstack = capstackbase;
   int capstacksize = INITCAPSTACKSIZE;
   int capstacktop = 0;
-  stack->X = NULL;
-  stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
+#if defined(LPEG_BUDGET)
+  long long steps = getbudget(stats);
+#endif
+  stack->p = &giveup; stack->s = s; stack->caplevel = 0;
+  profchoice(stack, prof->ncode);  /* (giveup is not a real choice) */
+  stack++;
   lua_pushlightuserdata(L, stackbase);
   lua_newtable(L); // Lambda (L for left recursion) Lua stack index lambdaidx
   lua_newtable(L); // Captures Lists  (Captures for left recursion) Lua stack index caplistsidx
@@ -321,19 +717,17 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   capstack->captop = captop;
   capstack->dyncaptop = ndyncap;
   capstack->capsize = capsize;
-  for (;;) {
-#if defined(DEBUG)
-      printf("s: |%s| stck:%d, dyncaps:%d, caps:%d  ",
-             s, stack - getstackbase(L, ptop), ndyncap, captop);
-      printinst(op, p);
-      printcaplist(capture, capture + captop);
 #endif
+  for (;;) {
     assert(dyncaplistidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
+    profinst(p);
+    traceinst(p);
+    yieldpoint();
     switch ((Opcode)p->i.code) {
       case IEnd: {
         assert(stack == getstackbase(L, ptop) + 1);
         capture[captop].kind = Cclose;
-        capture[captop].s = NULL;
+        capture[captop].index = MAXINDT;  /* mark end of the list */
         return s;
       }
       case IGiveup: {
@@ -341,23 +735,28 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         return NULL;
       }
       case IRet: {
-        if (!(stack - 1)->X) { // not LR return
-          assert(stack > getstackbase(L, ptop) && (stack - 1)->s == NULL);
+        assert(stack > getstackbase(L, ptop));
+        if ((stack - 1)->s == NULL) {  /* not LR return? */
           p = (--stack)->p;
+          profret(stack, s);
         }
         else
         {
-         const char* X = (stack - 1)->X;
+         const char* X = capstack->X;
+         assert((stack - 1)->caplevel == LRCALL);
          if (X == (char*)LRFAIL || s > X) { // rule lvar.1 inc.1
-           (stack - 1)->X = s;
-            p = (stack - 1)->pA;
+            proflrgrow();
+            tracelrgrow();
+            stats->lrgrowths++;
+            capstack->X = s;
+            p = capstack->pA;
             s = (stack - 1)->s;
-            (stack - 1)->caplevel = captop;
+            spendsteps(capstack->X);  /* will match the new seed again */
             lua_pushinteger(L, (p - op) * maxpointer + (s - o));
             lua_gettable(L, lambdaidx(ptop));
-            lua_pushinteger(L,(stack - 1)->X == (char*)LRFAIL ? LRFAIL : (stack - 1)->X - o);
+            lua_pushinteger(L, capstack->X - o);
             lua_setfield(L,-2,"X");
-            putcapturestolambda (L, ndyncap, captop, capstacktop, ptop);
+            putcapturestolambda (L, ndyncap, captop, ptop);
             lua_pop(L,1);
             if (ndyncap > 0)
               lua_pop(L, ndyncap);
@@ -371,9 +770,11 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         }
          else {  // rule inc.3
            int newdyncap, lambdaindex;
+           const Instruction *pA = capstack->pA;
            stack--;
            p = stack->p;
-           s = stack->X;
+           s = X;
+           profret(stack, s);
            capstacktop = removecapturesfromstack (L, capstacktop, ptop);
            capstack--;
            captop = capstack->captop;
@@ -381,8 +782,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
            newdyncap = capstack->dyncaptop;
            capture = getcapturesfromstack (L, ndyncap, newdyncap, capstacktop, ptop);
            ndyncap = newdyncap;
-           lambdaindex = (stack->pA - op) * maxpointer + (stack->s - o);
-           capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop);
+           lambdaindex = (pA - op) * maxpointer + (stack->s - o);
+           proflrmark();
+           capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop, stats);
+           proflrcopied();
            clearlambdaitem (L, lambdaindex, ptop);
          }
         }
@@ -415,6 +818,16 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         else goto fail;
         continue;
       }
+      case IString: {
+        int n = p->i.aux;
+        const char *str = (const char *)(p + 1)->buff;
+        int i;
+        if (e - s < n) goto fail;
+        for (i = 0; i < n && s[i] == str[i]; i++) ;
+        if (i < n) goto fail;
+        p += instsize(n); s += n;
+        continue;
+      }
       case ITestSet: {
         int c = (byte)*s;
         if (testchar((p + 2)->buff, c) && s < e)
@@ -442,11 +855,12 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       }
       case IChoice: {
         if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+          stack = doublestack(L, &stacklimit, ptop, stats);
         stack->p = p + getoffset(p);
         stack->s = s;
         stack->caplevel = captop;
-        stack->X = NULL;
+        profchoice(stack, p - op);
+        profdepth(stack);
         stack++;
         p += 2;
         continue;
@@ -454,11 +868,12 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case ICall: {
         int k = p->i.aux;
         if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+          stack = doublestack(L, &stacklimit, ptop, stats);
         if (k == 0) { // not LR call
           stack->s = NULL;
-          stack->X = NULL;
           stack->p = p + 2;  /* save return address */
+          profcall(stack, p + getoffset(p) - op, s);
+          profdepth(stack);
           stack++;
           p += getoffset(p);
         }
@@ -469,6 +884,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
          lua_pushinteger(L, lambdaindex);
          lua_gettable(L, lambdaidx(ptop));
          if (!lua_istable(L,-1)) {  // rule lvar.1 lvar.2
+           proflrentry();
            lua_pushinteger(L, lambdaindex);
            lua_newtable(L);
            lua_pushinteger(L, LRFAIL);
@@ -477,7 +893,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
            lua_setfield(L,-2,"k");
            lua_settable(L, lambdaidx(ptop));
            lua_pop(L, 1);
-           capstack = addcapturestostack(L, capstack, ndyncap, captop, &capstacksize, &capstacktop, ptop);
+           capstack = addcapturestostack(L, capstack, ndyncap, captop, capsize, &capstacksize, &capstacktop, ptop);
            if (ndyncap > 0)
              lua_pop(L, ndyncap);
            ndyncap = 0;
@@ -487,11 +903,13 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
            capstack->captop = captop;
            capstack->dyncaptop = ndyncap;
            capstack->capsize = capsize;
+           capstack->X = (char*)LRFAIL;
+           capstack->pA = pA;
            stack->p = p + 2;
-           stack->pA = pA;
            stack->s = s;
-           stack->X = (char*)LRFAIL;
-           stack->caplevel = captop;
+           stack->caplevel = LRCALL;
+           profcall(stack, pA - op, s);
+           profdepth(stack);
            stack++;
            p += getoffset(p);
           }
@@ -507,7 +925,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
             goto fail;
            else // rule  lvar.4
             {
-             capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop);
+             proflrmark();
+             capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop, stats);
+             proflrcopied();
+             profbytes(pA - op, (o + X_X) - s);
              p += 2;
              s = o + X_X;
             }
@@ -515,6 +936,62 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         }
         continue;
       }
+      /*
+      ** A memoized call looks for a previous result of the rule at the
+      ** current position; without one, it stacks an entry, as a choice
+      ** that goes to the following 'IMemoFail', and calls the rule,
+      ** which returns to 'IMemoEnd'. Results are not kept while a
+      ** left-recursive call is growing its seed, as they may change.
+      */
+      case IMemoCall: {
+        const Instruction *rule = p + getoffset(p);
+        Memo *memo = getmemo(L, ptop);
+        MemoEntry *m = memolookup(memo, rule, rule - op, s - o);
+        if (m != NULL) {  /* result is known? */
+          if (m->end == MAXINDT)  /* call failed? */
+            goto fail;
+          capture = memocaptures(L, memo, m, capture, &captop, &capsize,
+                                 ptop, capstacktop, stats);
+          profbytes(rule - op, (o + m->end) - s);
+          s = o + m->end;
+          p += 4;  /* skip 'IMemoEnd' and 'IMemoFail' */
+          continue;
+        }
+        if (stack == stacklimit)
+          stack = doublestack(L, &stacklimit, ptop, stats);
+        stack->p = p + 3;  /* 'IMemoFail' */
+        stack->s = s;
+        stack->caplevel = captop;
+        profchoice(stack, p - op);
+        profdepth(stack);
+        stack++;
+        if (stack == stacklimit)
+          stack = doublestack(L, &stacklimit, ptop, stats);
+        stack->s = NULL;
+        stack->p = p + 2;  /* 'IMemoEnd' */
+        profcall(stack, rule - op, s);
+        profdepth(stack);
+        stack++;
+        p = rule;
+        continue;
+      }
+      case IMemoEnd: {
+        const Instruction *rule = (p - 2) + getoffset(p - 2);
+        assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+        stack--;  /* remove entry of the call */
+        if (capstacktop == 1)  /* no left-recursive calls pending? */
+          memostore(getmemo(L, ptop), rule, rule - op, stack->s - o, s - o,
+                    capture + stack->caplevel, captop - stack->caplevel);
+        p += 2;
+        continue;
+      }
+      case IMemoFail: {
+        const Instruction *rule = (p - 3) + getoffset(p - 3);
+        if (capstacktop == 1)  /* no left-recursive calls pending? */
+          memostore(getmemo(L, ptop), rule, rule - op, s - o, MAXINDT,
+                    NULL, 0);
+        goto fail;
+      }
       case ICommit: {
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         stack--;
@@ -529,8 +1006,12 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case IBackCommit: {
+        const char *from = s;
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         s = (--stack)->s;
+        spendsteps(from);
+        if (ndyncap > 0)  /* are there matchtime captures? */
+          ndyncap -= removedyncap(L, capture, stack->caplevel, captop);
         captop = stack->caplevel;
         p += getoffset(p);
         continue;
@@ -538,16 +1019,27 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case IFailTwice:
         assert(stack > getstackbase(L, ptop));
         stack--;
-        /* go through */
+        /* FALLTHROUGH */
       case IFail:
       fail: { /* pattern failed: try to backtrack */
-        const char* X;
+        const char *from = s;
         int newdyncap;
-        do {  /* remove pending calls */
-          assert(stack > getstackbase(L, ptop));
-          s = (--stack)->s;
-          X = stack->X;
-          if (X == (char*)LRFAIL) { // rule lvar.2 rest
+        if (capstacktop == 1) {  /* no left-recursive calls pending? */
+          do {  /* remove pending calls */
+            assert(stack > getstackbase(L, ptop));
+            s = (--stack)->s;
+          } while (s == NULL);
+        }
+        else {
+          for (;;) {  /* remove pending calls and unseeded LR calls */
+            assert(stack > getstackbase(L, ptop));
+            s = (--stack)->s;
+            if (s == NULL)
+              continue;
+            if (stack->caplevel != LRCALL || capstack->X != (char*)LRFAIL)
+              break;
+            // rule lvar.2 rest
+            clearlambdaitem (L, (capstack->pA - op) * maxpointer + (s - o), ptop);
             capstacktop = removecapturesfromstack (L, capstacktop, ptop);
             capstack--;
             captop = capstack->captop;
@@ -555,17 +1047,15 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
             newdyncap = capstack->dyncaptop;
             capture = getcapturesfromstack (L, ndyncap, newdyncap, capstacktop, ptop);
             ndyncap = newdyncap;
-            clearlambdaitem (L, (stack->pA - op) * maxpointer + (s - o), ptop);
           }
-        } while (s == NULL || X == (char*)LRFAIL);
-
-        if (ndyncap > 0)  /* is there matchtime captures? */
-          ndyncap -= removedyncap(L, capture, stack->caplevel, captop);
+        }
         p = stack->p;
-        if (X) // rule inc.2
+        if (stack->caplevel == LRCALL) // rule inc.2
         {
          int lambdaindex;
-         s = X;
+         const Instruction *pA = capstack->pA;
+         s = capstack->X;
+         profret(stack, s);
          capstacktop = removecapturesfromstack (L, capstacktop, ptop);
          capstack--;
          captop = capstack->captop;
@@ -573,12 +1063,20 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
          newdyncap = capstack->dyncaptop;
          capture = getcapturesfromstack (L, ndyncap, newdyncap, capstacktop, ptop);
          ndyncap = newdyncap;
-         lambdaindex = (stack->pA - op) * maxpointer + (stack->s - o);
-         capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop);
+         lambdaindex = (pA - op) * maxpointer + (stack->s - o);
+         proflrmark();
+         capture = addcapturesfromlambda (L, lambdaindex, capture, &ndyncap, &captop, &capsize, capstacktop, ptop, stats);
+         proflrcopied();
          clearlambdaitem (L, lambdaindex, ptop);
         }
-        else
+        else {
+          if (ndyncap > 0)  /* is there matchtime captures? */
+            ndyncap -= removedyncap(L, capture, stack->caplevel, captop);
           captop = stack->caplevel;
+          profrestart(stack);
+        }
+        tracefail();
+        spendsteps(from);
         continue;
       }
       case ICloseRunTime: {
@@ -586,55 +1084,69 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         int rem, res, n;
         int fr = lua_gettop(L) + 1;  /* stack index of first result */
         cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
+        stats->cmtcalls++;
+#if !defined(LPEG_YIELD)
         n = runtimecap(&cs, capture + captop, s, &rem);  /* call function */
+#else
+        n = pushruntimecap(&cs, capture + captop, s);
+        ms->runtime = 1;
+        ms->rtop = fr - 1;
+        savestate();
+        lua_callk(L, n, LUA_MULTRET, 0, ms->k);  /* call it (may yield) */
+       runtimeresult:  /* (resume here after the call yielded) */
+        ms->runtime = 0;
+        fr = ms->rtop + 1;
+        n = closeruntimecap(L, capture + captop, ms->rtop, &rem);
+#endif
         captop -= n;  /* remove nested captures */
+        ndyncap -= rem;  /* update number of dynamic captures */
         fr -= rem;  /* 'rem' items were popped from Lua stack */
         res = resdyncaptures(L, fr, s - o, e - o);  /* get result */
         if (res == -1)  /* fail? */
           goto fail;
         s = o + res;  /* else update current position */
         n = lua_gettop(L) - fr + 1;  /* number of new captures */
-        ndyncap += n - rem;  /* update number of dynamic captures */
+        ndyncap += n;  /* update number of dynamic captures */
         if (n > 0) {  /* any new capture? */
-          if ((captop += n + 2) >= capsize) {
-            capture = doublecap(L, capture, captop, ptop, capstacktop);
-            capsize = 2 * captop;
+          captop += n + 2;
+          while (captop >= capsize) {  /* (copy only the old entries) */
+            capture = doublecap(L, capture, capsize, ptop, capstacktop, stats);
+            capsize *= 2;
           }
           /* add new captures to 'capture' list */
-          adddyncaptures(s, capture + captop - n - 2, n, fr);
+          adddyncaptures(s - o, capture + captop - n - 2, n, fr);
         }
         p++;
         continue;
       }
       case ICloseCapture: {
-        const char *s1 = s;
+        Capture *open = &capture[captop - 1];
         assert(captop > 0);
-        /* if possible, turn capture into a full capture */
-        if (capture[captop - 1].siz == 0 &&
-            s1 - capture[captop - 1].s < UCHAR_MAX) {
-          capture[captop - 1].siz = s1 - capture[captop - 1].s + 1;
+        /* if it has no nested captures, turn it into a full capture */
+        if (open->siz == 0) {
+          open->siz = (s - o) - open->index + 1;
           p++;
           continue;
         }
         else {
           capture[captop].siz = 1;  /* mark entry as closed */
-          capture[captop].s = s;
+          capture[captop].index = s - o;
           goto pushcapture;
         }
       }
       case IOpenCapture:
         capture[captop].siz = 0;  /* mark entry as open */
-        capture[captop].s = s;
+        capture[captop].index = s - o;
         goto pushcapture;
       case IFullCapture:
         capture[captop].siz = getoff(p) + 1;  /* save capture size */
-        capture[captop].s = s - getoff(p);
+        capture[captop].index = s - o - getoff(p);
         /* goto pushcapture; */
       pushcapture: {
         capture[captop].idx = p->i.key;
         capture[captop].kind = getkind(p);
         if (++captop >= capsize) {
-          capture = doublecap(L, capture, captop, ptop, capstacktop);
+          capture = doublecap(L, capture, captop, ptop, capstacktop, stats);
           capsize = 2 * captop;
         }
         p++;
@@ -647,4 +1159,5 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
 
 /* }====================================================== */
 
+#endif
 
@@ -13,6 +13,7 @@ typedef enum Opcode {
   IAny, /* if no char, fail */
   IChar,  /* if char != aux, fail */
   ISet,  /* if char not in buff, fail */
+  IString,  /* if next 'aux' chars are not those in buff, fail */
   ITestAny,  /* in no char, jump to 'offset' */
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
@@ -33,7 +34,10 @@ typedef enum Opcode {
   IFullCapture,  /* complete capture of last 'off' chars */
   IOpenCapture,  /* start a capture */
   ICloseCapture,
-  ICloseRunTime
+  ICloseRunTime,
+  IMemoCall,  /* call rule at 'offset', or reuse a memoized result */
+  IMemoEnd,  /* memoize a call that succeeded; skip next instruction */
+  IMemoFail  /* memoize a call that failed, and fail */
 } Opcode;
 
 
@@ -49,9 +53,80 @@ typedef union Instruction {
 } Instruction;
 
 
+/* result of 'match' when it runs out of its budget of steps */
+extern const char budgetexhausted;
+#define EXHAUSTED	(&budgetexhausted)
+
+/* result of 'resumematch' when it suspends the match */
+extern const char matchsuspended;
+#define SUSPENDED	(&matchsuspended)
+
+
+/*
+** Counters of all matches in a Lua state (see 'lpeg.stats'), followed
+** by the budget of steps for each match (see 'lpeg.setbudget'); they
+** live in a userdata in the registry, which each match looks up once
+** and gives to the virtual machine
+*/
+typedef struct Stats {
+  unsigned long matches;  /* number of matches */
+  unsigned long bytes;  /* bytes of subjects after the initial positions */
+  unsigned long failures;  /* matches that failed (or ran out of budget) */
+  unsigned long stackgrowths;  /* times a backtrack stack grew */
+  unsigned long capgrowths;  /* times a capture list grew */
+  unsigned long lrgrowths;  /* times a left-recursive seed grew */
+  unsigned long cmtcalls;  /* calls to match-time captures */
+  unsigned long maxstack;  /* largest size of a backtrack stack */
+  lua_Integer budget;  /* steps for each match (0 if no limit) */
+} Stats;
+
+
+#if LUA_VERSION_NUM >= 503
+
+/*
+** State of a yieldable match (see 'lpeg.yieldmatch'): the virtual
+** machine saves here its registers when it suspends. Everything else
+** lives in the Lua stack of the match, which survives the yield; in
+** particular, the backtrack stack and the capture lists are always
+** userdata there.
+*/
+typedef struct MatchState {
+  const char *o;  /* subject */
+  const char *e;  /* end of subject */
+  Instruction *op;  /* code of the pattern */
+  int ptop;  /* index of last argument to the match */
+  Stats *stats;  /* counters and budget of the Lua state */
+  const char *s;  /* current position */
+  const Instruction *p;  /* next instruction */
+  int stack;  /* first empty slot in the backtrack stack */
+  int stacksize;  /* size of the backtrack stack */
+  int captop;  /* first empty slot in the capture list */
+  int capsize;  /* size of the capture list */
+  int ndyncap;  /* number of dynamic captures (in Lua stack) */
+  int capstack;  /* current entry in the capture stack */
+  int capstacksize;  /* size of the capture stack */
+  int capstacktop;  /* number of entries in the capture stack */
+  int top;  /* Lua stack top when suspended */
+  int runtime;  /* suspended while calling a match-time capture? */
+  int rtop;  /* (runtime) stack top before that call */
+  long period;  /* number of instructions between yields */
+  long tick;  /* instructions left to the next yield */
+  long long steps;  /* steps left in the budget (see 'lpeg.setbudget') */
+  lua_KFunction k;  /* continuation for the match */
+} MatchState;
+
+void startmatch (lua_State *L, const char *s, MatchState *ms);
+const char *resumematch (lua_State *L, MatchState *ms);
+
+#endif
+
+
 void printpatt (Instruction *p, int n);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop);
+                   Instruction *op, Capture *capture, int ptop, Stats *stats);
+const char *budgetmatch (lua_State *L, const char *o, const char *s,
+                         const char *e, Instruction *op, Capture *capture,
+                         int ptop, Stats *stats);
 
 
 #endif
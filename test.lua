@@ -6,6 +6,10 @@
 
 local m = require"lpeg"
 
+-- optimization level of the compiler for the tests (see 'testopt.lua')
+local optlevel = tonumber(os.getenv("LPEG_OPTLEVEL") or 2)
+m.setoptlevel(optlevel)
+
 
 -- for general use
 local a, b, c, d, e, f, g, p, t
@@ -441,6 +445,24 @@ assert(p:match("abcxx") == 6)
 t = m.match(m.Ct(m.C('a')^0), string.rep("a", 10000))
 assert(#t == 10000 and t[1] == 'a' and t[#t] == 'a')
 
+-- long captures (not nested)
+do
+  local s = string.rep("x", 1000)
+  assert(m.match(m.C(m.P(1)^0), s) == s)
+  assert(m.match(m.Cs((m.P(1)^-600 / "") * m.C(1)^0), s) ==
+         string.rep("x", 400))
+  t = {m.match(m.C(m.P(1)^300) * m.Cp() * m.C(m.P(1)^0), s)}
+  assert(#t[1] == 1000 and t[2] == 1001 and t[3] == "")
+end
+
+-- nested table captures mixing positional values and named groups
+p = m.Ct((m.Ct(m.Cg(m.C(1), "k") * m.C(m.C(1)) * m.Cg(m.C(1) * m.C(1)) *
+               (m.P(1) / 0) * m.Cg(m.Cc(0), "z")) * m.C(1))^0)
+t = p:match(string.rep("abcdefg", 3))
+assert(#t == 6 and t[2] == 'f' and t[4] == 'e' and t[6] == 'd')
+checkeq(t[1], {k = 'a', z = 0, 'b', 'b', 'c', 'd'})
+checkeq(t[3], {k = 'g', z = 0, 'a', 'a', 'b', 'c'})
+
 print('+')
 
 
@@ -570,6 +592,9 @@ assert(m.match(#m.S'567' * 1, "6") == 2)
 
 
 -- tests for Tail Calls
+-- (without optimizations, the choices around the calls stay in the
+-- stack, so level 0 needs a larger one)
+if optlevel == 0 then m.setmaxstack(50000) end
 
 p = m.P{ 'a' * m.V(1) + '' }
 assert(p:match(string.rep('a', 1000)) == 1001)
@@ -599,6 +624,8 @@ assert(p:match(string.rep("011", 10000)))
 assert(not p:match(string.rep("011", 10000) .. "1"))
 assert(not p:match(string.rep("011", 10001)))
 
+m.setmaxstack(400)   -- restore default limit
+
 
 -- this grammar does need backtracking info.
 local lim = 10000
@@ -609,12 +636,393 @@ checkerr("stack overflow", m.match, p, string.rep("0", lim))
 m.setmaxstack(2*lim + 4)
 assert(m.match(p, string.rep("0", lim)) == lim + 1)
 
--- this repetition should not need stack space (only the call does)
+-- this repetition should not need stack space (only the call does;
+-- at level 0, its choices do too)
 p = m.P{ ('a' * m.V(1))^0 * 'b' + 'c' }
-m.setmaxstack(200)
+m.setmaxstack(optlevel > 0 and 200 or 1000)
 assert(p:match(string.rep('a', 180) .. 'c' .. string.rep('b', 180)) == 362)
 
+-- deeply nested captures are evaluated without C recursion
+lim = 50000
+p = m.P{ m.Ct("(" * m.V(1) * ")") + m.C"x" }
+m.setmaxstack(2*lim + 10)
+t = p:match(string.rep("(", lim) .. "x" .. string.rep(")", lim))
+for i = 1, lim do t = t[1] end
+assert(t == "x")
+p = m.P{ m.C("[" * m.Cg(m.V(1)) * "]") + m.Cc(0) }
+t = {p:match(string.rep("[", lim) .. string.rep("]", lim))}
+assert(#t == lim + 1 and t[lim] == "[]" and t[lim + 1] == 0)
+m.setmaxcapdepth(1000)
+checkerr("nesting too deep (current limit is 1000)", m.match, p,
+         string.rep("[", 1001) .. string.rep("]", 1001))
+assert(p:match(string.rep("[", 400) .. string.rep("]", 400)))  -- 800 frames
+m.setmaxcapdepth(5)   -- (below the initial number of frames)
+checkerr("nesting too deep (current limit is 5)", m.match, p,
+         string.rep("[", 20) .. string.rep("]", 20))
+assert(p:match("[[]]"))   -- 4 frames
+checkerr("nesting too deep", m.match,
+         m.Cmt(m.C(m.C(m.C(m.C(m.C(m.C(1)))))), function () return true end),
+         "a")
+m.setmaxcapdepth(200000)
+p = m.P{ m.Cs("(" * m.V(1) * ")") + m.P"x" / "y" }
+assert(p:match("((x))") == "((y))")
+checkerr("nested too deep", m.match, p, string.rep("(", 300) .. "x" ..
+                                        string.rep(")", 300))
+
+m.setmaxstack(100)   -- restore low limit
+
+-- budget of steps
+p = m.P{ "S"; S = (m.V"X" * "!" + 1)^0, X = m.P"a"^1 }
+m.setbudget(1000)
+assert(p:match(string.rep("a", 20)) == 21)
+assert(p:match(string.rep("a", 1000)) == false)
+assert(m.match(m.P"b", "a") == nil)
+assert(m.match(#m.P"aaaa" * 1, "aaaa") == 2)
+checkerr("out of range", m.setbudget, -1)
+m.setbudget(0)
+assert(p:match(string.rep("a", 1000)) == 1001)
+-- a predicate also goes back (1 step plus 2 characters)
+-- (the count of steps depends on the code for the predicate)
+if optlevel > 0 then
+  m.setbudget(2)
+  assert(m.match(#m.P"a"^1 * 1, "aa") == false)
+  m.setbudget(3)
+  assert(m.match(#m.P"a"^1 * 1, "aa") == 2)
+  m.setbudget(0)
+end
+-- each growth of a left-recursive seed matches the seed again
+p = m.P{ "E"; E = m.V"E" * "+n" + "n" }
+m.setbudget(1000)
+assert(p:match("n" .. string.rep("+n", 50)) == false)
+m.setbudget(0)
+assert(p:match("n" .. string.rep("+n", 50)) == 102)
+-- yieldable matches have the same budget, kept across their yields
+if m.yieldmatch then
+  p = (m.P"a"^0 * "b" + 1)^0 * -1
+  m.setbudget(100)
+  assert(m.match(p, string.rep("a", 200)) == false)
+  assert(m.yieldmatch(p, string.rep("a", 200)) == false)
+  m.setyieldsteps(1)
+  local co = coroutine.wrap(function ()
+    return "end", m.yieldmatch(p, string.rep("a", 200))
+  end)
+  local n = 0
+  repeat t, a = co(); n = n + 1 until t == "end"
+  assert(a == false and n > 2)
+  m.setyieldsteps(100000)
+  m.setbudget(0)
+  assert(m.yieldmatch(p, string.rep("a", 200)) == 201)
+end
+
+-- yieldable matches
+if m.yieldmatch then
+  m.setyieldsteps(100)
+  p = m.Ct((m.C(m.R"az"^1) + 1)^0)
+  local subj = string.rep("abc,def;", 1000)
+  local co = coroutine.wrap(function () return "end", m.yieldmatch(p, subj) end)
+  local n = 0
+  repeat t, a = co(); n = n + 1 until t == "end"
+  assert(n > 10 and #a == 2000 and a[2000] == "def")
+  assert(#m.yieldmatch(p, subj) == 2000)   -- not in a coroutine
+  -- match-time captures can yield
+  p = m.Cmt(m.C(1) * m.Cmt(m.C(1), function (s, i, c)
+        return i, coroutine.yield(c)
+      end), function (s, i, c1, c2)
+        return i, c1 .. coroutine.yield(c2)
+      end)
+  co = coroutine.wrap(function () return "end", m.yieldmatch(p, "xyz") end)
+  assert(co() == "y" and co("Y") == "Y" and co("+") == "end")
+  co = coroutine.wrap(function () return m.yieldmatch(p, "xyz") end)
+  co(); co("Y")
+  t = {co("+")}
+  assert(#t == 1 and t[1] == "x+")
+  m.setyieldsteps(1)
+  p = m.P{"E", E = m.V"E" * m.C"+" * m.V"N" + m.V"N", N = m.C(m.R"09"^1)}
+  co = coroutine.wrap(function () return "end", m.yieldmatch(p, "1+2+33") end)
+  repeat t = {co()} until t[1] == "end"
+  assert(table.concat(t, " ", 2) == "1 + 2 + 33")
+  m.setyieldsteps(100000)
+end
+
+-- profiling
+m.setinlinesize(0)   -- calls to small rules are not inlined, to be profiled
+p = m.P{ "S"; S = m.V"A" * ";" + m.V"A" * "x", A = m.C(m.R"az"^1) }
+t, a = m.profile(p, "abc;")
+assert(a == "abc" and t.instructions > 0)
+assert(t.backtracks == 0 or optlevel == 0)   -- (no tests at level 0)
+t, a = m.profile(p, "abx")
+assert(a == nil and t.listing:find("A:"))
+assert(t.backtracks == 1 or optlevel == 0)
+for _, r in ipairs(t.rules) do
+  if r.name == "A" then assert(r.calls == 2 and r.bytes == 6) end
+end
+assert(select('#', m.profile(m.C(1) * m.C(1), "xyz", 2)) == 3)
+-- rules entered by tail calls also have names and call counts
+-- (rules 3 and 2 are entered only by tail calls)
+t = m.profile(m.P{ "a" * m.V(3), "c" * m.V(1) + "", "b" * m.V(2) },
+              "abcabcab")
+assert(t.listing:find("\n3:\n") and t.listing:find("jmp %-> %d+ 2"))
+assert(#t.rules == 3)
+for _, r in ipairs(t.rules) do assert(r.calls == 3) end
+p = m.P{ "S"; S = (m.V"X" * "!" + 1)^0, X = m.P"a"^1 }
+t = m.profile(p, string.rep("a", 3000))
+if optlevel > 0 then   -- (without tests, there are more backtracks)
+  assert(t.backtracks == 3001 and t.maxdepth >= 3)
+  assert(t.bucketsize == 3 and #t.heatmap == 1001 and t.heatmap[1] == 3)
+  assert(#t.hotpositions == 10 and t.hotpositions[1].from == 1 and
+         t.hotpositions[1].to == 3)
+  assert(t.hotchoices[1].backtracks == 3000 and t.hotchoices[1].rule == "S")
+  t = m.profile(p, "")
+  assert(t.backtracks == 0 and #t.heatmap == 1 and #t.hotpositions == 0)
+end
+t = m.profile(m.P{ "E"; E = m.V"E" * "+" * m.C"n" + m.C"n" }, "n+n+n")
+assert(t.lrentries == 1 and t.lrgrowths == 3 and t.lrcapbytes > 0)
+
+-- tracing
+p = m.P{ "S"; S = m.C(m.R"az"^1) * m.V"T", T = ";" + "," * m.V"S" }
+do
+  local kinds = {}
+  local n, a, b = m.trace(function (kind, pc, pos, depth, captop)
+    kinds[#kinds + 1] = kind
+    assert(pc >= 0 and pos >= 1 and depth >= 1 and captop >= 0)
+  end, p, "ab,cd;")
+  assert(n == #kinds and n > 0 and a == "ab" and b == "cd")
+  local s, a = m.trace(n, p, "ab,cd;")
+  assert(a == "ab" and #s % n == 0)
+  local s1 = m.trace(1, p, "ab,cd;")   -- only the last event
+  assert(#s1 * n == #s and s:sub(-#s1) == s1)
+  local f
+  f, a = m.trace(3, m.P"ab" + "ac", "ad")   -- failed match
+  assert(a == nil and #f == 3 * #s1)
+  if string.unpack then
+    local ev = require"lptrace".decode(f)
+    assert(ev[3].kind == "fail" and ev[3].pc == -1 and ev[3].depth == 0)
+    assert(require"lptrace".render(p, s, "ab,cd;"):find("[ST]: ret"))
+  end
+end
+checkerr("boom", m.trace, function () error("boom") end, p, "a;")
+checkerr("out of range", m.trace, 0, p, "a;")
+
+m.setinlinesize(16)
+
+-- compilation statistics
+p, t = m.compilestats{ "S"; S = m.V"S" * "a" + "b" }
+assert(p:match("baa") == 4 and t.codesize > 0 and t.nodes > 0)
+assert(t.grammar >= 0 and t.verify >= 0 and t.codegen >= 0)
+do   -- compiles a copy, leaving the code of 'p' alone
+  local p1
+  p1, t = m.compilestats(p)
+  assert(p1 ~= p and p1:match("baa") == 4 and t.grammar == 0 and
+         t.peephole >= 0)
+  -- even while 'p' is matching
+  local q
+  q = m.P"a" * m.Cmt(m.P"b", function () m.compilestats(q); return true end)
+      * m.P"c"^1
+  assert(q:match("abccc") == 6)
+end
+
+-- long chains of choices (analyses are computed once per node)
+do
+  local function alt (i, j)
+    if i == j then return m.P("w" .. i .. "x") end
+    local mid = math.floor((i + j) / 2)
+    return alt(i, mid) + alt(mid + 1, j)
+  end
+  p, t = m.compilestats(alt(1, 20000) * -1)
+  assert(p:match("w12345x") == 8 and not p:match("w20001x"))
+  assert(t.analysis >= 0)
+end
+p, t = m.compilestats("abc")
+assert(p:match("abc") == 4 and t.nodes == 5)
+
+-- n-ary sequences and choices
+assert(m.seq{}:match("x") == 1 and not m.choice{}:match("x"))
+assert(m.seq{"a"}:match("ab") == 2 and m.choice{"", "a"}:match("a") == 1)
+p = m.choice{"ab", m.C"c" * m.Cc(1), false, m.S"xy", "z", m.Cc(2) * "d"}
+assert(p:match("ab") == 3 and not p:match("a") and p:match("y") == 2)
+assert(p:match("z") == 2 and p:match("d") == 2 and not p:match("e"))
+t = {p:match("c")}; assert(t[1] == "c" and t[2] == 1 and #t == 2)
+assert(m.choice{"a", true, m.Cmt(0, error)}:match("b") == 1)
+p = m.seq{m.C"a", "", m.Cc(3), m.C(m.P"b"^1), true, m.Cc(3)}
+t = {p:match("abb")}
+assert(t[1] == "a" and t[2] == 3 and t[3] == "bb" and t[4] == 3 and #t == 4)
+assert(not m.seq{"a", false, m.Cmt(0, error)}:match("a"))
+checkerr("table expected", m.seq, "a")
+do
+  local items = {}
+  for i = 1, 20000 do items[i] = m.P("w" .. i .. "x") / tostring end
+  p, t = m.compilestats(m.choice(items) * -1)
+  assert(p:match("w12345x") == "w12345x" and not p:match("w20001x"))
+end
+do   -- a long chain of choices is coded without recursion
+  local items = {}
+  for i = 1, 100000 do items[i] = m.C("k" .. i .. "x") end
+  p = m.choice(items)
+  assert(p:match("k100000x") == "k100000x" and not p:match("k0x"))
+end
+p, t = m.compilestats(m.seq{"a", "b", "c"})
+assert(p:match("abc") == 4 and t.nodes == 5)
+
+-- match statistics
+m.stats(true)   -- reset counters
+t = m.stats()
+assert(t.matches == 0 and t.failures == 0 and t.maxstack == 0)
+assert(m.P"a":match("xabc", 2) == 3 and m.P"a":match("b") == nil)
+assert(m.Cmt(1, function () return true end):match("x") == 2)
+p = m.P{ "E"; E = m.V"E" * "+" * m.C"n" + m.C"n" }
+assert(select('#', p:match(string.rep("n+", 1000) .. "n")) == 1001)
+p = m.P{ "S"; S = "(" * m.V"S" * ")" + "" }
+m.setmaxstack(2000)
+assert(p:match(string.rep("(", 500) .. string.rep(")", 500)) == 1001)
 m.setmaxstack(100)   -- restore low limit
+t = m.stats(true)
+assert(t.matches == 5 and t.failures == 1 and t.bytes == 3 + 1 + 1 + 2001 + 1000)
+assert(t.cmtcalls == 1 and t.lrgrowths == 1001)
+assert(t.stackgrowths > 0 and t.maxstack > 1000 and t.capgrowths > 0)
+assert(m.stats().matches == 0)
+m.setbudget(1)
+m.stats(true)   -- (the budget is not a counter)
+assert(m.match((m.P"a"^0 * "b" + 1)^0, "aaaa") == false)
+t = m.stats(true)
+assert(t.matches == 1 and t.failures == 1)
+m.setbudget(0)
+
+-- memoized rules
+do
+  local count = 0
+  local function counter (_, i) count = count + 1; return true end
+  p = m.P{ "S"; S = m.V"A" * "x" + m.V"A" * "y" + m.V"A" * "z",
+           A = m.Memo(m.Cmt(m.P"a"^1, counter) * m.C(m.P"b"^0)) }
+  assert(p:match("aabbz") == "bb" and count == 1)
+  count = 0
+  assert(p:match("aabbw") == nil and count == 1)
+  -- failures are memoized too
+  count = 0
+  p = m.P{ "S"; S = m.V"A" * "x" + m.V"A" + "q",
+           A = m.Memo(m.Cmt(m.P(true), counter) * "a") }
+  assert(p:match("q") == 2 and count == 1)
+  m.setmemosize(0)   -- no memoization
+  count = 0
+  assert(p:match("q") == 2 and count == 2)
+  m.setmemosize(2)
+  p = m.P{ "S"; S = m.Ct(m.V"A" * "x" + m.V"A" * "y"),
+           A = m.Memo(m.C"a"^1) }
+  assert(#p:match("aay") == 2 and #p:match(string.rep("a", 10) .. "y") == 10)
+  checkerr("out of range", m.setmemosize, -1)
+  m.setmemosize(1024)
+  -- outside a rule, 'Memo' does nothing
+  assert(m.match(m.Memo(m.C"a"), "a") == "a")
+end
+
+-- repeated subpatterns are coded once
+do
+  local function patt ()
+    local item = m.C(m.P"item" * m.S"xyz"^1 * m.Cg(m.R"09"^1 / tonumber))
+    return m.P{ "L"; L = item * ("," * item)^0 * -1 }
+  end
+  local p1, t1 = m.compilestats(patt())
+  m.setsharesize(1)
+  local p2, t2 = m.compilestats(patt())
+  m.setsharesize(0)   -- no sharing
+  local p3, t3 = m.compilestats(patt())
+  assert(optlevel < 2 or t2.codesize < t1.codesize)   -- (no sharing below 2)
+  assert(t1.codesize <= t3.codesize)
+  for _, s in ipairs{"itemx1,itemzy23", "itemx1,", "item1", "itemxx12"} do
+    local r1 = {p1:match(s)}; local r2 = {p2:match(s)}
+    local r3 = {p3:match(s)}
+    assert(#r1 == #r2 and #r2 == #r3)
+    for i = 1, #r1 do assert(r1[i] == r2[i] and r2[i] == r3[i]) end
+  end
+  assert(select(4, p2:match("itemx1,itemzy23")) == 23)
+  checkerr("out of range", m.setsharesize, -1)
+  m.setsharesize(64)
+end
+
+-- small rules are inlined in their calls
+do
+  local g = { "N"; N = m.C(m.V"D"^1) * ("." * m.V"D"^0)^-1 * m.V"E",
+              D = m.R"09", E = m.Cc"e" * m.P"e"^-1 }
+  m.setinlinesize(0)
+  local p1 = m.P(g)
+  p1:match("")   -- compile it now
+  m.setinlinesize(16)
+  local p2 = m.P(g)
+  for _, s in ipairs{"12.5e", "12.x", "x", "1e", "."} do
+    local a1, b1 = p1:match(s)
+    local a2, b2 = p2:match(s)
+    assert(a1 == a2 and b1 == b2)
+  end
+  assert(p2:match("12.5e") == "12")
+  -- no calls to 'D' nor 'E', and repetitions of 'D' become spans
+  local listing = m.profile(p2, "1").listing
+  assert(optlevel < 2 or (not listing:find("D:") and listing:find("span")))
+  assert(m.profile(p1, "1").listing:find("D:"))
+  checkerr("out of range", m.setinlinesize, -1)
+end
+
+-- calls to rules that cannot match the empty string are guarded by
+-- tests of their first sets, which fail without calling the rules
+do
+  m.setinlinesize(0)
+  local p = m.P{ "S"; S = "x" * m.V"A" + "y", A = m.S"ab" * m.V"A" + "c" }
+  p:match("")   -- compile it now
+  m.setinlinesize(16)
+  assert(p:match"xaabc" == 6 and not p:match"xd" and p:match"y" == 2)
+  local listing = m.profile(p, "xd").listing
+  local target = listing:match("testset %[%(61%-63%)%] %-> (%d+)")
+  assert(optlevel < 2 or listing:find(target .. "  fail"))
+end
+
+-- alternatives with a common prefix (without captures) are left factored
+do
+  local p = m.P"return" * m.S"ab" + m.P"return" * ";" + "x"
+  assert(p:match"returna" == 8 and p:match"return;" == 8 and p:match"x" == 2)
+  assert(not p:match"return" and not p:match"retur")
+  local listing = m.profile(p, "").listing
+  assert(optlevel < 2 or select(2, listing:gsub("72 65 74 75 72 6e", "")) == 1)
+  -- a prefix with captures stays in each alternative
+  local q = m.C"ab" * "c" + m.C"ab" * "d"
+  assert(q:match"abd" == "ab" and not q:match"abe")
+  assert(optlevel < 2 or
+         select(2, m.profile(q, "").listing:gsub("capture", "")) == 2)
+  local g = m.P{ "S"; S = m.V"I" * "(" + m.V"I" * "=" + "z", I = m.R"az"^1 }
+  assert(g:match"ab=" == 4 and g:match"z" == 2 and not g:match"ab")
+end
+
+-- runs of characters become strings, and unreachable code disappears
+do
+  local p = m.P"abc" * "d" + "x" * -m.P"y" * m.S"ab"
+  assert(p:match"abcd" == 5 and not p:match"abc" and not p:match"abce")
+  assert(p:match"xa" == 3 and not p:match"xya" and not p:match"x")
+  local listing = m.profile(p, "").listing
+  if optlevel == 2 then
+    assert(listing:find("string %(61 62 63 64%)") and not listing:find("any"))
+    assert(select(2, listing:gsub("\n", "")) == 9)
+  end
+end
+
+-- optimization levels (see also 'testopt.lua')
+do
+  local p = m.S"ab"^0 * "c" + "d"
+  local p0 = m.compile(p, 0)   -- a compiled copy
+  assert(p0 ~= p and p0:match"abac" == 5 and p0:match"d" == 2)
+  local listing = m.profile(p0, "").listing
+  assert(not listing:find("span") and not listing:find("test"))
+  local p1 = m.compile(p, 1)
+  assert(p1:match"abac" == 5 and m.profile(p1, "").listing:find("span"))
+  assert(m.compile("abc", 2):match("abc") == 4 and m.compile(m.P"x"):match"x")
+  -- left factoring does not change the tree of the pattern
+  p = m.P"ab" * "c" + m.P"ab" * "d"
+  listing = m.profile(m.compile(p, 0), "").listing
+  assert(p:match"abc" == 4 and p:match"abd" == 4)   -- compiles 'p' itself
+  assert(m.profile(m.compile(p, 0), "").listing == listing)
+  -- nor does compiling a pattern that is matching
+  p = m.P"a" * m.Cmt("b", function () m.compile(p, 0); return true end) *
+      m.P"c"^1
+  assert(p:match"abccc" == 6 and p:match"abc" == 4)
+  checkerr("out of range", m.setoptlevel, 3)
+  checkerr("out of range", m.compile, p, -1)
+end
 
 -- tests for optional start position
 assert(m.match("a", "abc", 1))
@@ -898,6 +1306,7 @@ badgrammar({"x", x = #(m.V(1) * 'a') }, "rule '1'")  -- inf. loop
 --badgrammar({ -(m.V(1) * 'a') }, "rule '1'")  -- inf. loop
 --badgrammar({"x", x = m.P'a'^-1 * m.V"x"}, "rule 'x'")  -- left recursive
 badgrammar({"x", x = m.P'a' * m.V"y"^1, y = #m.P(1)}, "rule 'x'")
+badgrammar({ #(m.V(2)^0), m.V(1) }, "rule '1'")  -- inf. loop (through a cycle)
 
 assert(m.match({'a' * -m.V(1)}, "aaa") == 2)
 assert(m.match({'a' * -m.V(1)}, "aaaa") == nil)
@@ -979,6 +1388,16 @@ checkeq(t, {'ab',
             'ab', 'abx', 'abxx',
             'ab', 'abx', 'abxx', 'abxxx'})
 
+-- back references see only groups not nested in previous captures
+p = m.Cg(m.C"a", "n") * m.C(m.Cg(m.C"b", "n") * m.Cb"n") *
+    m.Ct(m.Cg(m.C"c", "n")) * m.Cb"n" * m.Cg(m.Cc(1), 1) * m.Cb(1.0)
+checkeq({p:match"abc"}, {"b", "b", {n = "c"}, "a", 1})
+local key = {}
+p = m.Cg(m.C(1), key) * m.Cg(m.C(1), "k") * m.Cb(key) * m.Cb"k"
+checkeq({p:match"xy"}, {"x", "y"})
+p = m.Cg(m.C"x", "k") * m.Cg(m.C"y" * m.Cb"k", "k") * m.Cb"k"
+checkeq({p:match"xy"}, {"y", "x"})
+
 
 
 -- tests for match-time captures
@@ -1040,6 +1459,16 @@ p = (any - p)^0 * p * any^0 * -1
 
 assert(p:match'abbbc-bc ddaa' == 'BC')
 
+-- values of match-time captures dropped by a failing match-time capture
+-- or by an and predicate
+p = m.Cmt(m.Cmt(1, function () return true, "x" end),
+          function () return false end) +
+    m.C(1) * m.Cmt(1, function () return true, "y" end)
+checkeq({p:match"ab"}, {"a", "y"})
+p = #m.Cmt(#m.P'b', function (_, i) return i, "x" end)
+assert(not (p * 'ab'):match"bacbc")
+assert((p * m.C'b'):match"bacbc" == "b")
+
 do   -- match-time captures cannot be optimized away
   local touch = 0
   f = m.P(function () touch = touch + 1; return true end)
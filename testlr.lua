@@ -3,6 +3,10 @@ local re = require"re"
 
 local m = lpeg
 
+-- optimization level of the compiler for the tests (see 'testopt.lua')
+local optlevel = tonumber(os.getenv("LPEG_OPTLEVEL") or 2)
+m.setoptlevel(optlevel)
+
 
 local function checkeq(x, y, p)
     if p then print(x, y) end
@@ -203,4 +207,66 @@ local pat = [[
 local pat = re.compile(pat)
 assert(re.match("baabbaaa", pat) == 9)
 
+-- memoized rules inside left recursion
+local pat = m.P{ "E";
+    E = m.V"E" * m.C"+" * m.V"N" + m.V"E" * m.C"-" * m.V"N" + m.V"N",
+    N = m.Memo(m.C(m.R"09"^1)),
+}
+checkeq({pat:match("1+2-33")}, {"1", "+", "2", "-", "33"})
+
+-- long chains (capture lists of left-recursive calls grow)
+local pat = m.P{ "E";
+    E = m.V"E" * m.C(m.S"+-") * m.V"T" + m.V"T",
+    T = m.V"T" * m.C(m.S"*/") * m.V"F" + m.V"F",
+    F = m.C(m.R"09"^1) + "(" * m.V"E" * ")",
+} * -1
+local s = "1-2/3+4*5-6/7+8*9*(10-1)/11+12*13-14/15+16*17-18/19*(20-1)"
+for i = 1, 5 do assert(select("#", pat:match(s)) == 43) end
+s = "1" .. string.rep("+1", 999)
+assert(select("#", pat:match(s)) == 1999)
+
+
+-- analyses (and test-based code) go through left-recursive calls
+local pat = m.P{ "E"; E = m.V"E" * "+" * m.R"09" + m.R"09" }
+assert((pat^1):match("1+2") == 4)
+assert((pat^1 * -1):match("1+23") == 5)
+assert((-pat):match("+1") == 1 and not (-pat):match("1+"))
+assert((pat + "x"):match("x") == 2)
+
+-- a call reentering its seed fails, even when its rule cannot fail
+local pat = m.P{ (#m.P"b" * m.V(1))^-1 * m.P"b"^-1 }
+assert(pat:match("b") == 2 and pat:match("c") == 1)
+
+-- match-time captures of seeds (failing, or with seeds used many times)
+local function cmt (_, i, ...)
+  if i % 3 == 0 then return false end
+  return i, select('#', ...)
+end
+local pat = m.P{ (m.Cmt(m.V(1), cmt) * 1)^0 }
+assert(pat:match("aa") == 1 and pat:match("aaaaa") == 1)
+local V = m.V(1)
+local pat = m.P{ V * V * "c" + V * "a" +
+                 m.Cmt(m.P"", function (_, i) return i, 1 end) }
+assert(m.compile(pat, 0):match("a") == 1)
+checkeq({pat:match("aac")}, {1, 1})
+
+
+-- chains of left-recursive rules (r_i <- r_i '+' r_(i+1) / r_(i+1))
+local g = {"r1"}
+for i = 1, 10 do
+  local next = m.V("r" .. (i + 1))
+  g["r" .. i] = m.V("r" .. i) * "+" * next + next
+end
+g.r11 = m.R"09"
+assert(m.match(g, "1+2+3") == 6 and m.match(g, "1+") == 2)
+
+-- a large cycle of rules, without left recursion
+-- (with tail calls; at level 0, without tests, the choices around
+-- them stay in the stack)
+local g = {}
+for i = 1, 900 do g[i] = "x" * m.V(i % 900 + 1) + m.R"09" end
+if optlevel == 0 then m.setmaxstack(5000) end
+assert(m.match(g, string.rep("x", 2000) .. "1") == 2002)
+m.setmaxstack(400)   -- restore default limit
+
 print"OK"
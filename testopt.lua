@@ -0,0 +1,254 @@
+#!/usr/bin/env lua
+
+-- Equivalence of the optimization levels of the compiler (see
+-- 'lpeg.setoptlevel'): runs 'test.lua' and 'testlr.lua' under each
+-- level and then matches random grammars against random subjects,
+-- with each grammar compiled at each level, checking that all levels
+-- give the same results.
+--
+-- usage: lua testopt.lua [count [seed]]
+--   count: number of random grammars (default: 2000)
+--   seed:  seed for the random numbers (default: 1)
+-- A mismatch is reported with the grammar, the subject, and the
+-- results at each level; the level that differs from the literal
+-- translation (level 0) points to the pass to blame.
+
+local m = require"lpeg"
+
+local MAXLEVEL = 2
+
+local count = tonumber(arg[1] or 2000)
+local seed = tonumber(arg[2] or 1)
+
+
+-- run the test files under each level
+do
+  local lua = arg[-1] or "lua"
+  local dir = arg[0]:match("^(.*[/\\])") or ""
+  for _, file in ipairs{"test.lua", "testlr.lua"} do
+    for level = 0, MAXLEVEL do
+      local cmd = string.format("LPEG_OPTLEVEL=%d %s %s%s > /dev/null",
+                                level, lua, dir, file)
+      local res = os.execute(cmd)
+      if res ~= true and res ~= 0 then
+        error(string.format("'%s' failed at level %d", file, level))
+      end
+      print(string.format("%s at level %d: OK", file, level))
+    end
+  end
+end
+
+
+-- random grammars; each generator returns a description of its pattern,
+-- a function to build it, and whether it calls any rule (so that a
+-- predicate around it may hide left recursion)
+
+local leaves = {
+  {"'a'", function () return m.P"a" end},
+  {"'b'", function () return m.P"b" end},
+  {"'ab'", function () return m.P"ab" end},
+  {"'abc'", function () return m.P"abc" end},
+  {"[ab]", function () return m.S"ab" end},
+  {"[bc]", function () return m.S"bc" end},
+  {".", function () return m.P(1) end},
+  {"''", function () return m.P(true) end},
+}
+
+-- a match-time capture that depends only on its arguments
+local function cmt (_, i, ...)
+  if i % 3 == 0 then return false end
+  return i, select('#', ...)
+end
+
+local rnd
+local risky   -- current grammar has calls inside predicates?
+
+local function leaf (nrules)
+  if math.random() < 0.3 then
+    local k = math.random(nrules)
+    return "V" .. k, function () return m.V(k) end, true
+  end
+  local l = leaves[math.random(#leaves)]
+  return l[1], l[2], false
+end
+
+local ops = {
+  function (d, n)   -- sequence
+    local d1, b1, c1 = rnd(d - 1, n); local d2, b2, c2 = rnd(d - 1, n)
+    return "(" .. d1 .. " " .. d2 .. ")", function () return b1() * b2() end,
+           c1 or c2
+  end,
+  function (d, n)   -- choice
+    local d1, b1, c1 = rnd(d - 1, n); local d2, b2, c2 = rnd(d - 1, n)
+    return "(" .. d1 .. " / " .. d2 .. ")", function () return b1() + b2() end,
+           c1 or c2
+  end,
+  function (d, n)   -- choice of alternatives with a common prefix
+    local d0, b0, c0 = rnd(d - 2, n)
+    local d1, b1, c1 = rnd(d - 1, n); local d2, b2, c2 = rnd(d - 1, n)
+    return "(" .. d0 .. " " .. d1 .. " / " .. d0 .. " " .. d2 .. ")",
+           function () return b0() * b1() + b0() * b2() end, c0 or c1 or c2
+  end,
+  function (d, n)   -- optional
+    local d1, b1, c1 = rnd(d - 1, n)
+    return d1 .. "?", function () return b1()^-1 end, c1
+  end,
+  function (d, n)   -- repetition (of a pattern that consumes something)
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "(" .. d1 .. " .)*", function () return (b1() * 1)^0 end, c1
+  end,
+  function (d, n)   -- not predicate
+    local d1, b1, c1 = rnd(d - 1, n)
+    risky = risky or c1
+    return "!" .. d1, function () return -b1() end, c1
+  end,
+  function (d, n)   -- and predicate
+    local d1, b1, c1 = rnd(d - 1, n)
+    risky = risky or c1
+    return "&" .. d1, function () return #b1() end, c1
+  end,
+  function (d, n)   -- look behind (of a fixed-length leaf)
+    local l = leaves[math.random(#leaves)]
+    return "<" .. l[1], function () return m.B(l[2]()) end, false
+  end,
+  function (d, n)   -- simple capture
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "{" .. d1 .. "}", function () return m.C(b1()) end, c1
+  end,
+  function (d, n)   -- position and constant captures
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "{}" .. d1 .. "{`k`}",
+           function () return m.Cp() * b1() * m.Cc"k" end, c1
+  end,
+  function (d, n)   -- group and back capture
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "{:g: " .. d1 .. " :} =g",
+           function () return m.Cg(b1(), "g") * m.Cb"g" end, c1
+  end,
+  function (d, n)   -- table capture
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "{| " .. d1 .. " |}", function () return m.Ct(b1()) end, c1
+  end,
+  function (d, n)   -- substitution capture
+    local d1, b1, c1 = rnd(d - 1, n)
+    return "{~ " .. d1 .. " ~}", function () return m.Cs(b1()) end, c1
+  end,
+  function (d, n)   -- match-time capture
+    local d1, b1, c1 = rnd(d - 1, n)
+    return d1 .. " => cmt", function () return m.Cmt(b1(), cmt) end, c1
+  end,
+}
+
+function rnd (d, nrules)
+  if d <= 0 or math.random() < 0.2 then return leaf(nrules) end
+  return ops[math.random(#ops)](d, nrules)
+end
+
+-- a random grammar with its description, a function to build it,
+-- and whether it has calls inside predicates (its matches may take
+-- exponential time, if they hide left recursion); some rules are
+-- memoized
+local function grammar ()
+  local n = math.random(3)
+  local descs, builds = {}, {}
+  risky = false
+  for i = 1, n do
+    local d, b = rnd(4, n)
+    if math.random() < 0.2 then
+      d = "memo(" .. d .. ")"
+      local b1 = b
+      b = function () return m.Memo(b1()) end
+    end
+    descs[i] = "V" .. i .. " <- " .. d
+    builds[i] = b
+  end
+  return table.concat(descs, "\n"), function ()
+    local g = {}
+    for i = 1, n do g[i] = builds[i]() end
+    return m.Ct(m.P(g)) * m.Cp()
+  end, risky
+end
+
+
+-- string representation of a value (tables with their keys in order;
+-- a back capture may put a table inside itself)
+local function value (v, open)
+  if type(v) ~= "table" then return tostring(v) end
+  open = open or {}
+  if open[v] then return "{...}" end
+  open[v] = true
+  local t, keys = {}, {}
+  for k in pairs(v) do keys[#keys + 1] = k end
+  table.sort(keys, function (a, b) return tostring(a) < tostring(b) end)
+  for i, k in ipairs(keys) do
+    t[i] = tostring(k) .. "=" .. value(v[k], open)
+  end
+  open[v] = nil
+  return "{" .. table.concat(t, ",") .. "}"
+end
+
+-- string representation of the results of a match
+local function show (ok, ...)
+  if not ok then return "error: " .. tostring((...)) end
+  local t = {}
+  for i = 1, select('#', ...) do t[i] = value((select(i, ...))) end
+  return table.concat(t, " ")
+end
+
+
+-- Grammars without calls inside predicates are matched with no
+-- budget, by the regular virtual machine. The others (e.g., with left
+-- recursion inside predicates) may take exponential time, so they
+-- are matched with a budget; a match out of budget returns false, and
+-- is not compared, as the number of steps depends on the level.
+local BUDGET = 100000
+
+-- Subtrees of these small grammars never reach the default size for
+-- sharing, so each grammar is compiled with a share size and an inline
+-- size taken in rotation from these lists (of coprime lengths, so that
+-- all pairs occur): mostly small share sizes, for that pass to run, and
+-- inline sizes that inline all the rules they can, a few, or none.
+local SHARESIZES = {2, 1, 3, 5, 64}
+local INLINESIZES = {1000, 4, 0}
+
+math.randomseed(seed)
+m.setmaxstack(10000)   -- (levels may need different stack sizes)
+local nsubj, nbudgeted, nbudget = 0, 0, 0
+for i = 1, count do
+  local desc, build, risky = grammar()
+  local sharesize = SHARESIZES[i % #SHARESIZES + 1]
+  local inlinesize = INLINESIZES[i % #INLINESIZES + 1]
+  m.setsharesize(sharesize); m.setinlinesize(inlinesize)
+  local subjects = {}
+  for j = 1, 20 do
+    local t = {}
+    for k = 1, math.random(0, 8) do t[k] = string.char(96 + math.random(3)) end
+    subjects[j] = table.concat(t)
+  end
+  if pcall(build) then   -- a valid grammar?
+    local results = {}
+    m.setbudget(risky and BUDGET or 0)
+    for level = 0, MAXLEVEL do
+      local p = m.compile(build(), level)
+      for j, s in ipairs(subjects) do
+        local r = show(pcall(m.match, p, s))
+        if risky and (r == "false" or results[j] == "false") then
+          if results[j] ~= "false" then nbudget = nbudget + 1 end
+          results[j] = "false"   -- out of budget
+        elseif level == 0 then results[j] = r
+        elseif r ~= results[j] then
+          error(string.format("grammar %d (seed %d, share size %d, " ..
+                              "inline size %d), subject '%s':\n%s\n" ..
+                              "level 0: %s\nlevel %d: %s", i, seed, sharesize,
+                              inlinesize, s, desc, results[j], level, r))
+        end
+      end
+    end
+    nsubj = nsubj + #subjects
+    if risky then nbudgeted = nbudgeted + #subjects end
+  end
+end
+m.setbudget(0); m.setsharesize(64); m.setinlinesize(16)   -- (defaults)
+print(string.format("%d random grammars (%d matches, %d with a budget, " ..
+                    "%d out of budget) at levels 0-%d: OK", count, nsubj,
+                    nbudgeted, nbudget, MAXLEVEL))